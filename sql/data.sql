@@ -3,13 +3,28 @@ INSERT INTO users (username, password) VALUES
     ('user2', 'password2'),
     ('user3', 'password3');
 
-INSERT INTO messages (sender_id, receiver_id, message, timestamp) VALUES
-    (1, 2, 'Hello, user2!', 0),
-    (2, 1, 'Hello, user1!', 0),
-    (1, 3, 'Hello, user3!', 0),
-    (3, 1, 'Hello, user1!', 0);
-
-INSERT INTO global_messages (sender_id, message, timestamp) VALUES
-    (3, 'Global message 3', 0),
-    (1, 'Global message 1', 1),
-    (2, 'Global message 2', 2);
\ No newline at end of file
+INSERT INTO messages (sender_id, receiver_id, message, timestamp, seq) VALUES
+    (1, 2, 'Hello, user2!', 0, 1),
+    (2, 1, 'Hello, user1!', 0, 2),
+    (1, 3, 'Hello, user3!', 0, 1),
+    (3, 1, 'Hello, user1!', 0, 2);
+
+INSERT INTO global_messages (sender_id, message, timestamp, seq) VALUES
+    (3, 'Global message 3', 0, 1),
+    (1, 'Global message 1', 1, 2),
+    (2, 'Global message 2', 2, 3);
+
+INSERT INTO sequences (user1_id, user2_id, last_seq) VALUES
+    (1, 2, 2),
+    (1, 3, 2),
+    (0, 0, 3);
+
+INSERT INTO rooms (name, last_seq) VALUES
+    ('general', 1);
+
+INSERT INTO room_members (room_id, user_id) VALUES
+    (1, 1),
+    (1, 2);
+
+INSERT INTO room_messages (room_id, sender_id, message, timestamp, seq) VALUES
+    (1, 1, 'Welcome to #general', 0, 1);
\ No newline at end of file
@@ -10,14 +10,138 @@ CREATE TABLE messages (
     receiver_id INTEGER NOT NULL,
     message TEXT NOT NULL,
     timestamp INTEGER DEFAULT (strftime('%s','now')),
+    seq INTEGER NOT NULL,
     FOREIGN KEY (sender_id) REFERENCES users (id),
     FOREIGN KEY (receiver_id) REFERENCES users (id)
 );
 
+CREATE INDEX messages_conversation ON messages (sender_id, receiver_id, seq);
+
 CREATE TABLE global_messages (
     id INTEGER PRIMARY KEY AUTOINCREMENT,
     sender_id INTEGER NOT NULL,
     message TEXT NOT NULL,
     timestamp INTEGER DEFAULT (strftime('%s','now')),
+    seq INTEGER NOT NULL UNIQUE,
+    FOREIGN KEY (sender_id) REFERENCES users (id)
+);
+
+-- Last sequence number handed out per conversation. user1_id < user2_id for
+-- direct conversations, the global chatroom is (0, 0).
+CREATE TABLE sequences (
+    user1_id INTEGER NOT NULL,
+    user2_id INTEGER NOT NULL,
+    last_seq INTEGER NOT NULL,
+    PRIMARY KEY (user1_id, user2_id)
+);
+
+CREATE TABLE rooms (
+    id INTEGER PRIMARY KEY AUTOINCREMENT,
+    name TEXT NOT NULL UNIQUE,
+    last_seq INTEGER NOT NULL DEFAULT 0
+);
+
+CREATE TABLE room_members (
+    room_id INTEGER NOT NULL,
+    user_id INTEGER NOT NULL,
+    PRIMARY KEY (room_id, user_id),
+    FOREIGN KEY (room_id) REFERENCES rooms (id),
+    FOREIGN KEY (user_id) REFERENCES users (id)
+);
+
+CREATE INDEX room_members_user ON room_members (user_id);
+
+CREATE TABLE room_messages (
+    id INTEGER PRIMARY KEY AUTOINCREMENT,
+    room_id INTEGER NOT NULL,
+    sender_id INTEGER NOT NULL,
+    message TEXT NOT NULL,
+    timestamp INTEGER DEFAULT (strftime('%s','now')),
+    seq INTEGER NOT NULL,
+    UNIQUE (room_id, seq),
+    FOREIGN KEY (room_id) REFERENCES rooms (id),
     FOREIGN KEY (sender_id) REFERENCES users (id)
-);
\ No newline at end of file
+);
+
+-- How far each user has received and read each conversation. conversation is
+-- the other user, "#global" or "#<room name>".
+CREATE TABLE receipts (
+    user_id INTEGER NOT NULL,
+    conversation TEXT NOT NULL,
+    delivered_seq INTEGER NOT NULL DEFAULT 0,
+    read_seq INTEGER NOT NULL DEFAULT 0,
+    PRIMARY KEY (user_id, conversation),
+    FOREIGN KEY (user_id) REFERENCES users (id)
+);
+
+-- Full-text search indexes. These are external-content tables: the text
+-- lives only in messages/global_messages/room_messages and the triggers below
+-- keep the inverted index in sync with every insert/delete/update.
+--
+-- Next to the text, direct messages index "u<id>" for both of their users and
+-- room messages "r<id>" for their room, so a search only intersects posting
+-- lists instead of checking every match against the searcher's conversations.
+CREATE VIEW messages_search AS
+    SELECT id, message, 'u' || sender_id || ' u' || receiver_id AS participants FROM messages;
+
+CREATE VIEW room_messages_search AS
+    SELECT id, message, 'r' || room_id AS room FROM room_messages;
+
+CREATE VIRTUAL TABLE messages_fts USING fts5(
+    message,
+    participants,
+    content='messages_search',
+    content_rowid='id'
+);
+
+CREATE VIRTUAL TABLE global_messages_fts USING fts5(
+    message,
+    content='global_messages',
+    content_rowid='id'
+);
+
+CREATE VIRTUAL TABLE room_messages_fts USING fts5(
+    message,
+    room,
+    content='room_messages_search',
+    content_rowid='id'
+);
+
+CREATE TRIGGER messages_ai AFTER INSERT ON messages BEGIN
+    INSERT INTO messages_fts (rowid, message, participants) VALUES (new.id, new.message, 'u' || new.sender_id || ' u' || new.receiver_id);
+END;
+
+CREATE TRIGGER messages_ad AFTER DELETE ON messages BEGIN
+    INSERT INTO messages_fts (messages_fts, rowid, message, participants) VALUES ('delete', old.id, old.message, 'u' || old.sender_id || ' u' || old.receiver_id);
+END;
+
+CREATE TRIGGER messages_au AFTER UPDATE ON messages BEGIN
+    INSERT INTO messages_fts (messages_fts, rowid, message, participants) VALUES ('delete', old.id, old.message, 'u' || old.sender_id || ' u' || old.receiver_id);
+    INSERT INTO messages_fts (rowid, message, participants) VALUES (new.id, new.message, 'u' || new.sender_id || ' u' || new.receiver_id);
+END;
+
+CREATE TRIGGER global_messages_ai AFTER INSERT ON global_messages BEGIN
+    INSERT INTO global_messages_fts (rowid, message) VALUES (new.id, new.message);
+END;
+
+CREATE TRIGGER global_messages_ad AFTER DELETE ON global_messages BEGIN
+    INSERT INTO global_messages_fts (global_messages_fts, rowid, message) VALUES ('delete', old.id, old.message);
+END;
+
+CREATE TRIGGER global_messages_au AFTER UPDATE ON global_messages BEGIN
+    INSERT INTO global_messages_fts (global_messages_fts, rowid, message) VALUES ('delete', old.id, old.message);
+    INSERT INTO global_messages_fts (rowid, message) VALUES (new.id, new.message);
+END;
+
+CREATE TRIGGER room_messages_ai AFTER INSERT ON room_messages BEGIN
+    INSERT INTO room_messages_fts (rowid, message, room) VALUES (new.id, new.message, 'r' || new.room_id);
+END;
+
+CREATE TRIGGER room_messages_ad AFTER DELETE ON room_messages BEGIN
+    INSERT INTO room_messages_fts (room_messages_fts, rowid, message, room) VALUES ('delete', old.id, old.message, 'r' || old.room_id);
+END;
+
+CREATE TRIGGER room_messages_au AFTER UPDATE ON room_messages BEGIN
+    INSERT INTO room_messages_fts (room_messages_fts, rowid, message, room) VALUES ('delete', old.id, old.message, 'r' || old.room_id);
+    INSERT INTO room_messages_fts (rowid, message, room) VALUES (new.id, new.message, 'r' || new.room_id);
+END;
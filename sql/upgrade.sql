@@ -0,0 +1,24 @@
+-- Copies a database from before sequence numbers (users, messages and
+-- global_messages only) into a new one created from schema.sql. bin/db
+-- upgrade attaches the old database as "old" and runs this in the new one.
+-- Messages are numbered per conversation in the order they were stored; the
+-- search indexes fill up through the insert triggers.
+INSERT INTO users (id, username, password)
+    SELECT id, username, password FROM old.users;
+
+INSERT INTO messages (id, sender_id, receiver_id, message, timestamp, seq)
+    SELECT id, sender_id, receiver_id, message, timestamp,
+        ROW_NUMBER() OVER (PARTITION BY min(sender_id, receiver_id), max(sender_id, receiver_id) ORDER BY id)
+    FROM old.messages;
+
+INSERT INTO global_messages (id, sender_id, message, timestamp, seq)
+    SELECT id, sender_id, message, timestamp, ROW_NUMBER() OVER (ORDER BY id)
+    FROM old.global_messages;
+
+INSERT INTO sequences (user1_id, user2_id, last_seq)
+    SELECT min(sender_id, receiver_id), max(sender_id, receiver_id), MAX(seq)
+    FROM messages
+    GROUP BY 1, 2;
+
+INSERT INTO sequences (user1_id, user2_id, last_seq)
+    SELECT 0, 0, MAX(seq) FROM global_messages HAVING COUNT(*) > 0;
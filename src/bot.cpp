@@ -0,0 +1,83 @@
+#include <fstream>
+#include <memory>
+#include <vector>
+#include "libchat.h"
+
+// Logs in every account of a credentials file and answers each direct
+// message with an echo. All accounts share one thread and one event loop,
+// each is a coroutine that waits on its own session.
+
+struct Bot {
+    std::string username;
+    std::string password;
+    std::unique_ptr<ChatSession> session;
+};
+
+Task<void> runBot(Bot& bot, std::string serverIP, int port, SSL_CTX* tlsContext) {
+    ChatSession& session = *bot.session;
+    // Awaited outside the conditions, GCC 12 never starts a task awaited in one
+    bool connected = co_await session.connect(serverIP, port, tlsContext);
+    if (!connected) {
+        co_return;
+    }
+    bool loggedIn = co_await session.login(bot.username, bot.password);
+    if (!loggedIn) {
+        std::cerr << bot.username << ": login failed" << std::endl;
+        co_return;
+    }
+    std::cout << bot.username << " is online" << std::endl;
+    while (true) {
+        Message message = co_await session.next();
+        if (message.type == Message::Type::CLOSE) {
+            std::cerr << bot.username << ": connection lost" << std::endl;
+            co_return;
+        }
+        // Only direct messages; rooms and the global chatroom would echo every bot's echo
+        if (message.type != Message::Type::CHAT || message.receiver != bot.username) {
+            continue;
+        }
+        session.acknowledge(message.sender, "read", message.sequence);
+        Message ack = co_await session.send(message.sender, message.content);
+        if (ack.type == Message::Type::ERROR) {
+            std::cerr << bot.username << ": reply to " << message.sender << " refused, " << ack.content << std::endl;
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 5 && !(argc == 7 && std::string(argv[5]) == "--tls")) {
+        std::cerr << "Usage: " << argv[0] << " <serverIP> <port> --credentials <file> [--tls <CA certificate file>]" << std::endl;
+        std::cerr << "The credentials file has a \"<username> <password>\" line per bot" << std::endl;
+        return 1;
+    }
+    try {
+        int port = std::stoi(argv[2]);
+        if (port < 0 || port > 65535) {
+            std::cerr << "Invalid port number" << std::endl;
+            return 1;
+        }
+        std::ifstream credentials(argv[4]);
+        if (std::string(argv[3]) != "--credentials" || !credentials) {
+            std::cerr << "Cannot open " << argv[4] << std::endl;
+            return 1;
+        }
+        SSL_CTX* tlsContext = argc == 7 ? tlsClientContext(argv[6]) : nullptr;
+
+        EventLoop loop;
+        std::vector<Bot> bots;
+        std::string username, password;
+        while (credentials >> username >> password) {
+            bots.push_back({username, password, std::make_unique<ChatSession>(loop)});
+        }
+        for (Bot& bot : bots) {
+            loop.spawn(runBot(bot, argv[1], port, tlsContext));
+        }
+        loop.run();
+    }
+    catch (const std::exception &e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,115 @@
+#include "capture.h"
+#include <cstring>
+#include <iostream>
+
+namespace {
+
+template <typename T>
+void append(std::string& buffer, T value) {
+    buffer.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void appendString(std::string& buffer, const std::string& value) {
+    append<uint32_t>(buffer, value.size());
+    buffer += value;
+}
+
+template <typename T>
+bool readValue(FILE* file, T& value) {
+    return fread(&value, sizeof(value), 1, file) == 1;
+}
+
+// A length past the end of the file is a corrupt or cut off capture, and
+// nothing is allocated for it
+bool readString(FILE* file, long fileSize, std::string& value) {
+    uint32_t size;
+    if (!readValue(file, size) || size > fileSize - ftell(file)) {
+        return false;
+    }
+    value.resize(size);
+    return size == 0 || fread(&value[0], size, 1, file) == 1;
+}
+
+}
+
+CaptureWriter::CaptureWriter(const std::string& path, bool resume) : start(std::chrono::steady_clock::now()) {
+    file = fopen(path.c_str(), resume ? "a+b" : "wb");
+    if (file == NULL) {
+        std::cerr << "Cannot open capture file " << path << std::endl;
+        exit(1);
+    }
+    int64_t now = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    if (resume && fseek(file, 0, SEEK_END) == 0 && ftell(file) > 0) {
+        // Records carry on from the time the capture started
+        char magic[sizeof(CAPTURE_MAGIC)];
+        int64_t started;
+        rewind(file);
+        if (!readValue(file, magic) || std::memcmp(magic, CAPTURE_MAGIC, sizeof(magic)) != 0 || !readValue(file, started)) {
+            std::cerr << "Not a capture file: " << path << std::endl;
+            exit(1);
+        }
+        start -= std::chrono::microseconds(now - started);
+        return;
+    }
+    buffer.append(CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC));
+    append<int64_t>(buffer, now);
+}
+
+CaptureWriter::~CaptureWriter() {
+    flush();
+    fclose(file);
+}
+
+void CaptureWriter::record(uint32_t connection, const Message& message) {
+    append<uint64_t>(buffer, std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count());
+    append<uint32_t>(buffer, connection);
+    append<uint8_t>(buffer, static_cast<uint8_t>(message.type));
+    append<int64_t>(buffer, std::chrono::duration_cast<std::chrono::seconds>(message.timestamp.time_since_epoch()).count());
+    append<int64_t>(buffer, message.sequence);
+    appendString(buffer, message.sender);
+    appendString(buffer, message.type == Message::Type::AUTH ? "" : message.receiver);
+    appendString(buffer, message.content);
+}
+
+void CaptureWriter::flush() {
+    if (buffer.empty()) {
+        return;
+    }
+    if (fwrite(buffer.data(), buffer.size(), 1, file) != 1 || fflush(file) != 0) {
+        std::cerr << "Error writing capture file" << std::endl;
+    }
+    buffer.clear();
+}
+
+CaptureReader::CaptureReader(const std::string& path) {
+    file = fopen(path.c_str(), "rb");
+    char magic[sizeof(CAPTURE_MAGIC)];
+    int64_t started;
+    if (file == NULL || !readValue(file, magic) || std::memcmp(magic, CAPTURE_MAGIC, sizeof(magic)) != 0 || !readValue(file, started)) {
+        std::cerr << "Not a capture file: " << path << std::endl;
+        exit(1);
+    }
+    long position = ftell(file);
+    fseek(file, 0, SEEK_END);
+    size = ftell(file);
+    fseek(file, position, SEEK_SET);
+}
+
+CaptureReader::~CaptureReader() {
+    fclose(file);
+}
+
+bool CaptureReader::next(CaptureRecord& record) {
+    uint8_t type;
+    int64_t timestamp;
+    Message& message = record.message;
+    if (!readValue(file, record.micros) || !readValue(file, record.connection) || !readValue(file, type) ||
+        !readValue(file, timestamp) || !readValue(file, message.sequence) ||
+        !readString(file, size, message.sender) || !readString(file, size, message.receiver) || !readString(file, size, message.content)) {
+        return false;
+    }
+    message.type = static_cast<Message::Type>(type);
+    message.timestamp = std::chrono::system_clock::time_point(std::chrono::seconds(timestamp));
+    message.token = "";
+    return true;
+}
@@ -0,0 +1,62 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include "utils.h"
+
+// Binary capture of the messages a server received, for replaying real traffic
+// with chat_replay. The file starts with CAPTURE_MAGIC and the wall clock time
+// the capture started (microseconds since the epoch), then one record per
+// message:
+//
+//   uint64 micros since the capture started
+//   uint32 connection id (counts up from 1, never reused within a capture)
+//   uint8  type
+//   int64  timestamp, int64 sequence
+//   sender, receiver, content: uint32 length + bytes each
+//
+// Tokens are never written and the password of an AUTH message is blanked.
+// A CLOSE record marks the end of a connection. A server taking over in a hot
+// restart appends to the capture of the server before it, keeping its clock
+// and connection ids.
+const char CAPTURE_MAGIC[8] = {'C', 'H', 'A', 'T', 'C', 'A', 'P', '1'};
+
+struct CaptureRecord {
+    uint64_t micros;
+    uint32_t connection;
+    Message message;
+};
+
+class CaptureWriter {
+public:
+    // Appends to an existing capture when resume is set, else starts a new one
+    CaptureWriter(const std::string& path, bool resume);
+    ~CaptureWriter();
+
+    void record(uint32_t connection, const Message& message);
+
+    // Records are buffered until the server's next flush
+    void flush();
+    bool pending() const {
+        return !buffer.empty();
+    }
+
+private:
+    FILE* file;
+    std::chrono::steady_clock::time_point start;
+    std::string buffer;
+};
+
+class CaptureReader {
+public:
+    explicit CaptureReader(const std::string& path);
+    ~CaptureReader();
+
+    // false at the end of the capture, or where it is cut off or corrupt
+    bool next(CaptureRecord& record);
+
+private:
+    FILE* file;
+    long size;
+};
@@ -0,0 +1,366 @@
+#include "chat_session.h"
+#include "tls.h"
+#include <sys/epoll.h>
+#include <netinet/tcp.h>
+#include <algorithm>
+#include <cerrno>
+
+// What requests and next() yield once the connection is gone
+static Message closedMessage() {
+    return {
+        .type = Message::Type::CLOSE,
+        .sender = "",
+        .receiver = "",
+        .content = "",
+        .token = "",
+        .timestamp = std::chrono::system_clock::now()
+    };
+}
+
+std::vector<HistoryEntry> parseHistory(std::string_view history) {
+    std::vector<HistoryEntry> entries;
+    while (!history.empty()) {
+        size_t end = history.find('\n');
+        std::string_view line = history.substr(0, end);
+        history = end == std::string_view::npos ? std::string_view() : history.substr(end + 1);
+        HistoryEntry entry;
+        std::string_view sender;
+        std::string_view content;
+        if (parseHistoryLine(line, entry.sequence, entry.timestamp, sender, content)) {
+            entry.sender = sender;
+            entry.content = content;
+            entries.push_back(std::move(entry));
+        }
+    }
+    return entries;
+}
+
+ChatSession::Reply::Reply(ChatSession& session, Message request) : session(&session) {
+    if (!session.connected()) {
+        response = closedMessage();
+        done = true;
+        return;
+    }
+    // Queued before it is written, the response can come no earlier than that
+    session.pending.push_back({this});
+    session.write(request);
+}
+
+ChatSession::Reply::~Reply() {
+    if (!done) {
+        for (Pending& pending : session->pending) {
+            if (pending.reply == this) {
+                pending.reply = nullptr;
+            }
+        }
+    }
+}
+
+ChatSession::Incoming::~Incoming() {
+    if (waiting && !done) {
+        auto reader = std::find(session->readers.begin(), session->readers.end(), this);
+        if (reader != session->readers.end()) {
+            session->readers.erase(reader);
+        }
+    }
+}
+
+Message ChatSession::Incoming::await_resume() {
+    if (done) {
+        return std::move(message);
+    }
+    if (!session->inbox.empty()) {
+        Message next = std::move(session->inbox.front());
+        session->inbox.pop_front();
+        return next;
+    }
+    return closedMessage();
+}
+
+ChatSession::ChatSession(EventLoop& loop) : loop(loop) {}
+
+ChatSession::~ChatSession() {
+    close();
+}
+
+Task<bool> ChatSession::connect(std::string host, int port, SSL_CTX* tlsContext) {
+    close();
+    sockaddr_in serveraddr;
+    serveraddr.sin_family = AF_INET;
+    serveraddr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host.c_str(), &serveraddr.sin_addr) != 1) {
+        std::cerr << "Invalid server address " << host << std::endl;
+        co_return false;
+    }
+    int socketfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int connected = ::connect(socketfd, (struct sockaddr*)&serveraddr, sizeof(serveraddr));
+    if (connected < 0 && errno == EINPROGRESS) {
+        co_await loop.writable(socketfd);
+        int error = 0;
+        socklen_t length = sizeof(error);
+        getsockopt(socketfd, SOL_SOCKET, SO_ERROR, &error, &length);
+        connected = error == 0 ? 0 : -1;
+    }
+    if (connected < 0) {
+        std::cerr << "Error connecting to server" << std::endl;
+        ::close(socketfd);
+        co_return false;
+    }
+    // Requests are single writes already, Nagle would only hold them back
+    int optval = 1;
+    setsockopt(socketfd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+    if (tlsContext) {
+        TlsStatus status;
+        while ((status = tlsConnectNonblocking(tlsContext, socketfd, host)) == TlsStatus::PENDING) {
+            co_await loop.readable(socketfd);
+        }
+        if (status == TlsStatus::FAILED) {
+            ::close(socketfd);
+            co_return false;
+        }
+    }
+    fd = socketfd;
+    loop.watch(fd, this, EPOLLIN);
+    co_return true;
+}
+
+Task<bool> ChatSession::login(std::string username, std::string password) {
+    token = "";
+    // Named rather than built in the co_await, GCC 12 destroys such a temporary twice
+    Message message {
+        .type = Message::Type::AUTH,
+        .sender = username,
+        .receiver = password,
+        .content = "",
+        .token = "",
+        .timestamp = std::chrono::system_clock::now()
+    };
+    Message response = co_await request(std::move(message));
+    if (response.type != Message::Type::AUTH || response.token.empty()) {
+        co_return false;
+    }
+    user = response.sender;
+    token = response.token;
+    co_return true;
+}
+
+ChatSession::Reply ChatSession::request(Message message) {
+    message.token = token;
+    message.timestamp = std::chrono::system_clock::now();
+    return Reply(*this, std::move(message));
+}
+
+ChatSession::Reply ChatSession::command(const std::string& content, const std::string& receiver, int64_t sequence) {
+    return request({
+        .type = Message::Type::COMMAND,
+        .sender = user,
+        .receiver = receiver,
+        .content = content,
+        .token = "",
+        .timestamp = {},
+        .sequence = sequence
+    });
+}
+
+ChatSession::Reply ChatSession::send(const std::string& receiver, const std::string& content) {
+    return request({
+        .type = Message::Type::CHAT,
+        .sender = user,
+        .receiver = receiver,
+        .content = content,
+        .token = "",
+        .timestamp = {}
+    });
+}
+
+ChatSession::Reply ChatSession::history(const std::string& conversation, int64_t sequence) {
+    return command(conversation.empty() ? "globalChat" : isRoom(conversation) ? "roomChat" : "chat", conversation, sequence);
+}
+
+void ChatSession::acknowledge(const std::string& conversation, const std::string& kind, int64_t sequence) {
+    if (sequence <= 0 || !connected()) {
+        return;
+    }
+    write({
+        .type = Message::Type::ACK,
+        .sender = user,
+        .receiver = conversation,
+        .content = kind,
+        .token = token,
+        .timestamp = std::chrono::system_clock::now(),
+        .sequence = sequence
+    });
+}
+
+ChatSession::Incoming ChatSession::next() {
+    return Incoming(*this);
+}
+
+void ChatSession::close() {
+    if (fd < 0) {
+        return;
+    }
+    loop.unwatch(fd);
+    tlsForget(fd);
+    ::close(fd);
+    fd = -1;
+    input.clear();
+    output.clear();
+    written = 0;
+    retryLength = 0;
+    watchingWrites = false;
+
+    Message closed = closedMessage();
+    std::deque<Pending> abandoned;
+    abandoned.swap(pending);
+    for (Pending& request : abandoned) {
+        Message response = closed;
+        respond(request, response);
+    }
+    while (!readers.empty()) {
+        Message message = closed;
+        deliver(message);
+    }
+}
+
+void ChatSession::ready(uint32_t events) {
+    if (events & EPOLLOUT) {
+        flush();
+    }
+    if (fd < 0 || !(events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+        return;
+    }
+    // Take everything there is; with userspace TLS this also empties
+    // OpenSSL's buffer, which epoll cannot see
+    bool open = true;
+    char buffer[16384];
+    while (true) {
+        ssize_t bytes = tlsRead(fd, buffer, sizeof(buffer));
+        if (bytes > 0) {
+            input.append(buffer, bytes);
+            continue;
+        }
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        open = bytes < 0 && errno == EAGAIN;
+        break;
+    }
+    size_t offset = 0;
+    Message message;
+    // Dispatching can close the session (a failed PONG, or a coroutine it
+    // resumes), which drops the input along with everything else
+    while (fd >= 0) {
+        size_t size = decodeMessage(std::string_view(input).substr(offset), message);
+        if (size == 0) {
+            break;
+        }
+        if (size == MALFORMED_MESSAGE) {
+            std::cerr << "Malformed message from the server" << std::endl;
+            open = false;
+            break;
+        }
+        offset += size;
+        dispatch(message);
+    }
+    if (fd < 0) {
+        return;
+    }
+    input.erase(0, offset);
+    if (!open) {
+        close();
+    }
+}
+
+void ChatSession::write(const Message& message) {
+    output += encodeMessage(message);
+    flush();
+}
+
+void ChatSession::flush() {
+    while (fd >= 0 && written < output.size()) {
+        size_t length = retryLength > 0 ? retryLength : output.size() - written;
+        ssize_t bytes = tlsWrite(fd, output.data() + written, length);
+        if (bytes > 0) {
+            written += bytes;
+            retryLength = 0;
+            continue;
+        }
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes < 0 && errno == EAGAIN) {
+            // OpenSSL wants a write it could not finish repeated with the same length
+            retryLength = length;
+            if (!watchingWrites) {
+                loop.watch(fd, this, EPOLLIN | EPOLLOUT);
+                watchingWrites = true;
+            }
+            return;
+        }
+        close();
+        return;
+    }
+    output.clear();
+    written = 0;
+    if (watchingWrites && fd >= 0) {
+        loop.watch(fd, this, EPOLLIN);
+        watchingWrites = false;
+    }
+}
+
+void ChatSession::dispatch(Message& message) {
+    if (message.type == Message::Type::PING) {
+        write({
+            .type = Message::Type::PONG,
+            .sender = "",
+            .receiver = "",
+            .content = "",
+            .token = token,
+            .timestamp = std::chrono::system_clock::now()
+        });
+        return;
+    }
+    bool response = message.type == Message::Type::AUTH || message.type == Message::Type::COMMAND ||
+        message.type == Message::Type::ERROR ||
+        (message.type == Message::Type::ACK && (message.content == "sent" || message.content == "rejected"));
+    if (!response) {
+        deliver(message);
+        return;
+    }
+    // An ERROR names the type of what it refuses. Receipts have no response
+    // to wait for, so a refused one is news for the application, and so is
+    // an ERROR about no request at all (e.g. "server full").
+    bool unrequested = message.type == Message::Type::ERROR &&
+        (message.sender.empty() || message.sender == messageTypeName(Message::Type::ACK));
+    if (unrequested || pending.empty()) {
+        deliver(message);
+        return;
+    }
+    respond(pending.front(), message);
+    pending.pop_front();
+}
+
+void ChatSession::respond(Pending& request, Message& message) {
+    Reply* reply = request.reply;
+    if (reply == nullptr) {
+        return;
+    }
+    reply->response = std::move(message);
+    reply->done = true;
+    if (reply->waiting) {
+        loop.post(reply->waiting);
+    }
+}
+
+void ChatSession::deliver(Message& message) {
+    if (readers.empty()) {
+        inbox.push_back(std::move(message));
+        return;
+    }
+    Incoming* reader = readers.front();
+    readers.pop_front();
+    reader->message = std::move(message);
+    reader->done = true;
+    loop.post(reader->waiting);
+}
@@ -0,0 +1,157 @@
+#pragma once
+#include <openssl/ssl.h>
+#include <coroutine>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "event_loop.h"
+#include "task.h"
+#include "utils.h"
+
+struct HistoryEntry {
+    int64_t sequence;
+    int64_t timestamp;
+    std::string sender;
+    std::string content;
+};
+
+// The entries of a chat/globalChat/roomChat response
+std::vector<HistoryEntry> parseHistory(std::string_view history);
+
+// One connection to a chat server, driven by an EventLoop. Nothing blocks:
+// writes are buffered and flushed as the socket takes them, reads are decoded
+// as they arrive.
+//
+// The server answers requests in the order they came in, so every response
+// (AUTH, COMMAND, ERROR, and the sent/rejected ACK of a CHAT) goes to the
+// oldest request still waiting. Everything else it sends, chat messages, the
+// receipts of other users and ERRORs refusing a receipt or about no request,
+// queues up for next(). Server PINGs are answered here, so a quiet session
+// stays connected without any timer.
+//
+//     ChatSession session(loop);
+//     bool connected = co_await session.connect("127.0.0.1", 8000);
+//     bool loggedIn = co_await session.login("bot", "secret");
+//     Message ack = co_await session.send("alice", "hello");
+//     Message incoming = co_await session.next();
+//
+// A session must outlive the coroutines waiting on it. GCC 12 miscompiles a
+// co_await in an if condition and a braced temporary passed to one, so await
+// into a variable and build messages beforehand.
+class ChatSession : private Watcher {
+public:
+    // co_await yields the response to a request: its usual response, an
+    // ERROR when the server refused it, or a CLOSE when the connection is gone
+    class Reply {
+    public:
+        Reply(const Reply&) = delete;
+        Reply& operator=(const Reply&) = delete;
+        ~Reply();
+        bool await_ready() const noexcept {
+            return done;
+        }
+        void await_suspend(std::coroutine_handle<> handle) noexcept {
+            waiting = handle;
+        }
+        Message await_resume() {
+            return std::move(response);
+        }
+    private:
+        friend class ChatSession;
+        Reply(ChatSession& session, Message request);
+
+        ChatSession* session;
+        Message response;
+        bool done = false;
+        std::coroutine_handle<> waiting;
+    };
+
+    // co_await yields the next message that is not a response, a CLOSE once
+    // the connection is gone
+    class Incoming {
+    public:
+        Incoming(const Incoming&) = delete;
+        Incoming& operator=(const Incoming&) = delete;
+        ~Incoming();
+        bool await_ready() const noexcept {
+            return !session->inbox.empty() || session->fd < 0;
+        }
+        void await_suspend(std::coroutine_handle<> handle) {
+            waiting = handle;
+            session->readers.push_back(this);
+        }
+        Message await_resume();
+    private:
+        friend class ChatSession;
+        explicit Incoming(ChatSession& session) : session(&session) {}
+
+        ChatSession* session;
+        Message message;
+        bool done = false;
+        std::coroutine_handle<> waiting;
+    };
+
+    explicit ChatSession(EventLoop& loop);
+    ~ChatSession();
+    ChatSession(const ChatSession&) = delete;
+    ChatSession& operator=(const ChatSession&) = delete;
+
+    // Connect, over TLS when tlsContext is set; reasons for failing go to stderr
+    Task<bool> connect(std::string host, int port, SSL_CTX* tlsContext = nullptr);
+    // False when the server did not accept the credentials
+    Task<bool> login(std::string username, std::string password);
+
+    // Send message with this session's token and the current time
+    Reply request(Message message);
+    // A COMMAND, the response's content holds the result
+    Reply command(const std::string& content, const std::string& receiver = "", int64_t sequence = 0);
+    // Chat to a user, a "#<room>" or "" for the global chatroom. The ACK
+    // response carries the message's sequence number.
+    Reply send(const std::string& receiver, const std::string& content);
+    // The messages of a conversation (named like a receiver) after sequence,
+    // see parseHistory
+    Reply history(const std::string& conversation, int64_t sequence = 0);
+    // Receipts ("delivered" or "read") get no response; a refused one comes
+    // through next() as an ERROR with sender "ACK"
+    void acknowledge(const std::string& conversation, const std::string& kind, int64_t sequence);
+
+    Incoming next();
+
+    // Closing wakes everything waiting on the session with a CLOSE
+    void close();
+    bool connected() const {
+        return fd >= 0;
+    }
+    const std::string& username() const {
+        return user;
+    }
+
+private:
+    // A request waiting for its response
+    struct Pending {
+        Reply* reply; // null when the request was abandoned
+    };
+
+    void ready(uint32_t events) override;
+    void write(const Message& message);
+    void flush();
+    void dispatch(Message& message);
+    void respond(Pending& pending, Message& message);
+    void deliver(Message& message);
+
+    EventLoop& loop;
+    int fd = -1;
+    std::string user;
+    std::string token;
+    std::string input;
+    std::string output;
+    // Bytes of output already written
+    size_t written = 0;
+    // Length of a TLS write that has to be repeated as it was
+    size_t retryLength = 0;
+    bool watchingWrites = false;
+    std::deque<Pending> pending;
+    std::deque<Message> inbox;
+    std::deque<Incoming*> readers;
+};
@@ -1,10 +1,12 @@
 #include <vector>
 #include <algorithm>
-#include <atomic>
-#include <thread>
 #include <unordered_map>
 #include <iomanip>
-#include "utils.h"
+#include <memory>
+#include <sstream>
+#include "libchat.h"
+#include "history_cache.h"
+#include <sys/stat.h>
 
 std::vector<std::string> split(const std::string& str, char delimiter) {
     std::vector<std::string> tokens;
@@ -16,44 +18,36 @@ std::vector<std::string> split(const std::string& str, char delimiter) {
     return tokens;
 }
 
-void listenThreadFunc(std::atomic<bool>& chatting, int serverfd, std::string username) {
-    while (chatting.load()) {
-        // Listen for new Messages from server
-        fd_set readSet;
-        FD_ZERO(&readSet);
-        FD_SET(serverfd, &readSet);
-        
-        struct timeval timeout;
-        timeout.tv_sec = 0;
-        timeout.tv_usec = 100000; // 100ms timeout
-        
-        int ready = select(serverfd + 1, &readSet, NULL, NULL, &timeout);
-
-        if (ready > 0 && FD_ISSET(serverfd, &readSet)) {
-            Message newMessage;
-            if (!receiveMessage(serverfd, newMessage)) {
-                return;
-            }
-            if (newMessage.receiver != username) {
-                // Ignore message not intended for us
-                continue;
-            }
-            std::cout << "\033[2K\r";
-            std::cout << "[" << formatTimestamp(std::stoi(timePointToString(newMessage.timestamp))) << "] " << newMessage.sender << ": " << newMessage.content << std::endl;
-            std::cout.flush();
-            std::cout << "Send a message > ";
-            std::cout.flush();
-        }
-    }
-}
+// Conversation histories are cached here, next to the server's var directory
+const std::string CACHE_DIRECTORY = "../var/cache";
+// How much of a conversation is shown when it is opened
+const int HISTORY_SHOWN = 500;
 
+// The interactive client is one coroutine on an EventLoop, next to one that
+// shows incoming messages. Keyboard input is read through the loop as well,
+// so the server's messages are handled while the user is typing and no
+// threads are needed.
 class ChatClient {
 private:
-    sockaddr_in serveraddr;
-    int serverfd;
+    EventLoop& loop;
+    ChatSession session;
+    std::string serverIP;
+    int port;
+    SSL_CTX* tlsContext;
+    // Keyboard input read but not yet used
+    std::string input;
     std::string username;
-    std::string token;
-    std::atomic<bool> chatting;
+    bool listening = false;
+    // Set while a conversation is open: its other user, "" for the global chatroom
+    bool chatting = false;
+    std::string otherUser;
+    // Newest sequence number shown in the open conversation
+    int64_t latestSequence = 0;
+    // Newest sequence number seen per conversation (other user, or "#global")
+    std::unordered_map<std::string, int64_t> lastSeen;
+    // "<serverIP>_<port>", keeps the caches of different servers apart
+    std::string serverName;
+    std::unique_ptr<HistoryCache> cache;
     const std::unordered_map<std::string, std::string> commands = {
         {"h", "Show this help"},
         {"q", "Disconnect and quit"},
@@ -61,48 +55,151 @@ private:
         {"users", "List online users"},
         {"chat", "Enter the chatroom"},
         {"global", "Enter the global chatroom"},
+        {"search", "Search your message history"},
+        {"rooms", "List, join and enter rooms"},
         {"logout", "Logout"}
     };
 public:
 
-    ChatClient(char* serverIP, int port) {
-        sockaddr_in serveraddr;
-        serveraddr.sin_family = AF_INET;
-        serveraddr.sin_port = htons(port);
-        serveraddr.sin_addr.s_addr = inet_addr(serverIP);
-        serverfd = socket(AF_INET, SOCK_STREAM, 0);
-        if (connect(serverfd, (struct sockaddr*)&serveraddr, sizeof(serveraddr)) < 0) {
-            std::cerr << "Error connecting to server" << std::endl;
+    // tlsContext is null for a plaintext connection
+    ChatClient(EventLoop& loop, const std::string& serverIP, int port, SSL_CTX* tlsContext)
+        : loop(loop), session(loop), serverIP(serverIP), port(port), tlsContext(tlsContext) {
+        serverName = serverIP + "_" + std::to_string(port);
+    }
+
+    // The next line typed, without its newline. Quits at the end of the input.
+    Task<std::string> readLine() {
+        while (true) {
+            size_t end = input.find('\n');
+            if (end != std::string::npos) {
+                std::string line = input.substr(0, end);
+                input.erase(0, end + 1);
+                co_return line;
+            }
+            co_await loop.readable(STDIN_FILENO);
+            char buffer[4096];
+            ssize_t bytes = read(STDIN_FILENO, buffer, sizeof(buffer));
+            if (bytes < 0 && (errno == EINTR || errno == EAGAIN)) {
+                continue;
+            }
+            if (bytes <= 0) {
+                if (!input.empty()) {
+                    input += '\n';
+                    continue;
+                }
+                session.close();
+                exit(0);
+            }
+            input.append(buffer, bytes);
+        }
+    }
+
+    // The first word of the next line that has one
+    Task<std::string> readWord() {
+        std::string word;
+        while (word.empty()) {
+            std::string text = co_await readLine();
+            std::stringstream line(text);
+            line >> word;
+        }
+        co_return word;
+    }
+
+    // A refusal is reported and leaves an empty reply
+    void receiveReply(Message& message) {
+        if (message.type == Message::Type::CLOSE) {
+            std::cerr << "Connection to server lost" << std::endl;
+            exit(1);
+        }
+        if (message.type == Message::Type::ERROR) {
+            std::cout << "Server refused the request: " << message.content << std::endl;
+            message.content = "";
+            message.token = "";
+        }
+    }
+
+    Task<void> connect() {
+        // Awaited outside the condition, GCC 12 never starts a task awaited in one
+        bool connected = co_await session.connect(serverIP, port, tlsContext);
+        if (!connected) {
             exit(1);
         }
-        chatting.store(false);
+        if (!listening) {
+            listening = true;
+            loop.spawn(listen());
+        }
+    }
+
+    // Shows what the server sends on its own while a conversation is open
+    Task<void> listen() {
+        TimestampFormatter formatter;
+        while (true) {
+            Message newMessage = co_await session.next();
+            if (newMessage.type == Message::Type::CLOSE) {
+                listening = false;
+                co_return;
+            }
+            if (!chatting) {
+                // Whatever arrives in the menus is fetched again when its conversation is opened
+                continue;
+            }
+            if (newMessage.type == Message::Type::ERROR) {
+                std::cout << "\033[2K\r";
+                std::cout << "Server says: " << newMessage.content << std::endl;
+                std::cout << "Send a message > ";
+                std::cout.flush();
+                continue;
+            }
+            if (newMessage.type == Message::Type::ACK) {
+                if (newMessage.content == "read" && !otherUser.empty() && newMessage.sender == otherUser) {
+                    std::cout << "\033[2K\r";
+                    std::cout << "Seen by " << otherUser << std::endl;
+                    std::cout << "Send a message > ";
+                    std::cout.flush();
+                }
+                continue;
+            }
+            bool forThisChat = otherUser.empty() || isRoom(otherUser) ? newMessage.receiver == otherUser : newMessage.receiver == username && newMessage.sender == otherUser;
+            if (newMessage.type != Message::Type::CHAT || !forThisChat) {
+                // Ignore message not intended for this chat
+                continue;
+            }
+            latestSequence = std::max(latestSequence, newMessage.sequence);
+            std::cout << "\033[2K\r";
+            std::string time;
+            formatter.append(time, std::chrono::duration_cast<std::chrono::seconds>(newMessage.timestamp.time_since_epoch()).count());
+            std::cout << "[" << time << "] " << newMessage.sender << ": " << newMessage.content << std::endl;
+            std::cout << "Send a message > ";
+            std::cout.flush();
+        }
     }
 
-    void authenticate() {
+    Task<void> authenticate() {
         std::cout << "Please login" << std::endl;
         std::cout << "Username: ";
-        std::string user;
-        std::cin >> user;
+        std::cout.flush();
+        std::string user = co_await readWord();
         std::cout << "Password: ";
-        std::string password;
-        std::cin >> password;
-        Message message {
-            .type = Message::Type::AUTH,
-            .sender = user,
-            .receiver = password,
-            .content = "",
-            .token = "",
-            .timestamp = std::chrono::system_clock::now()
-        };
-        sendMessage(serverfd, message);
-        emptySocket(serverfd);
-        receiveMessage(serverfd, message);
-        token = message.token;
-        if (token == "") {
+        std::cout.flush();
+        std::string password = co_await readWord();
+        // The server hangs up on connections that take too long to log in
+        if (!session.connected()) {
+            co_await connect();
+        }
+        bool loggedIn = co_await session.login(user, password);
+        if (!loggedIn) {
             std::cout << "Authentication failed!" << std::endl;
             exit(1);
         }
-        username = message.sender;
+        username = session.username();
+        // Whatever is cached has been seen
+        mkdir("../var", 0755);
+        mkdir(CACHE_DIRECTORY.c_str(), 0755);
+        cache = std::make_unique<HistoryCache>(CACHE_DIRECTORY + "/" + username + "@" + serverName + ".sqlite3");
+        lastSeen.clear();
+        for (const auto& conversation : cache->highWaters()) {
+            lastSeen[conversation.first] = conversation.second;
+        }
     }
     void printHelp() {
         std::cout << "Commands: " << std::endl;
@@ -114,112 +211,194 @@ public:
         }
     }
 
-    std::vector<std::string> printChatroom() {
+    Task<std::vector<std::string>> printChatroom() {
         std::cout << "Welcome to the Chat Room" << std::endl;
         std::cout << "Type the number of the user you want to chat with" << std::endl;
-        Message message {
-            .type = Message::Type::COMMAND,
-            .sender = "",
-            .receiver = "",
-            .content = "allUsers",
-            .token = token,
-            .timestamp = std::chrono::system_clock::now()
-        };
-        sendMessage(serverfd, message);
-        emptySocket(serverfd);
-        receiveMessage(serverfd, message);
+        Message message = co_await session.command("allUsers");
+        receiveReply(message);
         std::vector<std::string> users = split(message.content, '\n');
-        for (int i = 0; i < users.size(); i++) {
+        for (size_t i = 0; i < users.size(); i++) {
             std::cout << "(" << i + 1 << ") " << users[i] << std::endl;
         }
         std::cout << "(q) back to menu" << std::endl;
-        return users;
+        co_return users;
+    }
+
+    struct RoomEntry {
+        std::string name;
+        std::string members;
+        bool joined;
+    };
+
+    Task<std::vector<RoomEntry>> printRooms() {
+        std::cout << "Rooms" << std::endl;
+        Message message = co_await session.command("rooms");
+        receiveReply(message);
+        std::vector<RoomEntry> rooms;
+        for (const auto& line : split(message.content, '\n')) {
+            std::stringstream ss(line);
+            RoomEntry room;
+            std::string joined;
+            ss >> room.name >> room.members >> joined;
+            room.joined = joined == "1";
+            rooms.push_back(room);
+        }
+        for (size_t i = 0; i < rooms.size(); i++) {
+            std::cout << "(" << i + 1 << ") " << rooms[i].name << " - " << rooms[i].members << " members" << (rooms[i].joined ? " (joined)" : "") << std::endl;
+        }
+        std::cout << "Type a number to enter a room, \"j <name>\" to join or create one, \"l <number>\" to leave one" << std::endl;
+        std::cout << "(q) back to menu" << std::endl;
+        co_return rooms;
+    }
+
+    // Join or leave a room, prints the server's answer
+    Task<void> membership(std::string command, std::string room) {
+        Message message = co_await session.command(command, room);
+        receiveReply(message);
+        std::cout << message.content << std::endl;
+    }
+
+    Task<void> roomsMenu() {
+        clearScreen();
+        std::vector<RoomEntry> rooms = co_await printRooms();
+        while (true) {
+            std::cout << "> ";
+            std::cout.flush();
+            std::string input = co_await readLine();
+            if (input == "q") {
+                clearScreen();
+                printHelp();
+                co_return;
+            }
+            if (input.rfind("j ", 0) == 0) {
+                std::string name = input.substr(2);
+                std::string room = isRoom(name) ? name : "#" + name;
+                co_await membership("joinRoom", room);
+                rooms = co_await printRooms();
+                continue;
+            }
+            int roomID;
+            bool leave = input.rfind("l ", 0) == 0;
+            try {
+                roomID = std::stoi(leave ? input.substr(2) : input);
+            }
+            catch (const std::exception &e) {
+                std::cerr << "Error: " << e.what() << std::endl;
+                continue;
+            }
+            if (roomID < 1 || static_cast<size_t>(roomID) > rooms.size()) {
+                std::cout << "Invalid room" << std::endl;
+                continue;
+            }
+            const RoomEntry room = rooms[roomID - 1];
+            if (leave) {
+                co_await membership("leaveRoom", room.name);
+                rooms = co_await printRooms();
+                continue;
+            }
+            if (!room.joined) {
+                co_await membership("joinRoom", room.name);
+            }
+            // chat() shows the room list again when it returns
+            co_await chat(room.name);
+            rooms[roomID - 1].joined = true;
+        }
     }
 
     void clearScreen() {
         std::cout << "\033[2J\033[1;1H" << std::flush;
     }
 
-    void chatroom() {
+    Task<void> chatroom() {
         clearScreen();
-        std::vector<std::string> users = printChatroom();
+        std::vector<std::string> users = co_await printChatroom();
         while (true) {
             std::cout << "> ";
-            std::string chatInput;
-            std::getline(std::cin, chatInput);
+            std::cout.flush();
+            std::string chatInput = co_await readLine();
             if (chatInput == "q") {
                 clearScreen();
                 printHelp();
-                return;
+                co_return;
             }
+            int userID;
             try {
-                int userID = std::stoi(chatInput);
-                if (userID < 1 || userID > users.size()) {
-                    std::cout << "Invalid user ID" << std::endl;
-                    continue;
-                }
-                chat(users[userID - 1]);
+                userID = std::stoi(chatInput);
             }
             catch (const std::exception &e) {
                 std::cerr << "Error: " << e.what() << std::endl;
                 continue;
             }
+            if (userID < 1 || static_cast<size_t>(userID) > users.size()) {
+                std::cout << "Invalid user ID" << std::endl;
+                continue;
+            }
+            co_await chat(users[userID - 1]);
         }
     }
 
-    void chat(std::string otherUser) {
+    Task<void> chat(std::string other) {
         clearScreen();
-        if (otherUser == "") {
+        if (other == "") {
             std::cout << "Welcome to the global chatroom" << std::endl;
         }
+        else if (isRoom(other)) {
+            std::cout << "Welcome to " << other << std::endl;
+        }
         else {
-            std::cout << "Chat with " << otherUser << std::endl;
+            std::cout << "Chat with " << other << std::endl;
         }
 
-        Message message = {
-            .type = Message::Type::COMMAND,
-            .sender = username,
-            .receiver = otherUser,
-            .content = otherUser == "" ? "globalChat" : "chat",
-            .token = token,
-            .timestamp = std::chrono::system_clock::now()
-        };
-
         std::cout << "Type \"!q\" to go back to menu" << std::endl;
 
-        // Get chat history from server
-        sendMessage(serverfd, message);
-        emptySocket(serverfd);
-        receiveMessage(serverfd, message);
-        std::stringstream ss(message.content);
-        std::string line;
-        while (std::getline(ss, line)) {
-            std::stringstream msg(line);
-            std::string timestamp, sender, content;
-            msg >> timestamp >> sender;
-            std::getline(msg, content);
-            std::cout << "[" << formatTimestamp(std::stoi(timestamp)) << "] " << sender << ":" << content << std::endl;
-        }
+        // Only ask the server for what the cache does not have yet
+        const std::string conversation = other == "" ? "#global" : other;
+        Message message = co_await session.history(other, cache->highWater(conversation));
+        receiveReply(message);
+        cache->store(conversation, message.content);
+
+        // Render the whole screen into one buffer and write it at once
+        int64_t newest = lastSeen[conversation];
+        std::string screen;
+        TimestampFormatter formatter;
+        cache->latest(conversation, HISTORY_SHOWN, [&](int64_t sequence, int64_t timestamp, std::string_view sender, std::string_view content) {
+            newest = std::max(newest, sequence);
+            screen += '[';
+            formatter.append(screen, timestamp);
+            screen += "] ";
+            screen += sender;
+            screen += ": ";
+            screen += content;
+            screen += '\n';
+        });
+        std::cout.write(screen.data(), screen.size());
+        std::cout.flush();
+        latestSequence = newest;
+        session.acknowledge(other, "read", latestSequence);
 
-        chatting.store(true);
-        // Start a thread that listens for new chat messages from the server
-        std::thread listenThread(listenThreadFunc, std::ref(chatting), serverfd, otherUser == "" ? "" : username);
+        // From here on listen() shows what arrives for this conversation
+        otherUser = other;
+        chatting = true;
 
         while (true) {
             std::cout << "Send a message > ";
-            std::string chatInput;
-            std::getline(std::cin, chatInput);
+            std::cout.flush();
+            std::string chatInput = co_await readLine();
             if (chatInput == "!q") {
-                chatting.store(false);
-                listenThread.join();
+                chatting = false;
+                lastSeen[conversation] = latestSequence;
+                session.acknowledge(other, "read", latestSequence);
                 clearScreen();
-                if (otherUser == "") {
+                if (other == "") {
                     printHelp();
                 }
+                else if (isRoom(other)) {
+                    co_await printRooms();
+                }
                 else {
-                    printChatroom();
+                    co_await printChatroom();
                 }
-                return;
+                co_return;
             }
             // Remove leading whitespace
             chatInput.erase(chatInput.begin(), std::find_if(chatInput.begin(), chatInput.end(), [](unsigned char ch) {
@@ -232,28 +411,115 @@ public:
             }
             auto now = std::chrono::system_clock::now();
             auto duration = std::chrono::duration_cast<std::chrono::seconds>(now.time_since_epoch());
-            std::cout << "[" << formatTimestamp(duration.count()) << "] " << username << ": " << chatInput << std::endl;
-            // Send message to server about this chat
-            message = {
-                .type = Message::Type::CHAT,
-                .sender = username,
-                .receiver = otherUser,
-                .content = chatInput,
-                .token = token,
-                .timestamp = now
-            };
-            sendMessage(serverfd, message);
+            std::string time;
+            formatter.append(time, duration.count());
+            std::cout << "[" << time << "] " << username << ": " << chatInput << std::endl;
+            Message ack = co_await session.send(other, chatInput);
+            if (ack.type == Message::Type::CLOSE) {
+                receiveReply(ack);
+            }
+            else if (ack.type == Message::Type::ERROR) {
+                std::cout << "Not sent, server says: " << ack.content << std::endl;
+            }
+            else if (ack.content == "rejected") {
+                std::cout << "Not sent, you are not a member of " << other << std::endl;
+            }
+            else {
+                latestSequence = std::max(latestSequence, ack.sequence);
+            }
         }
     }
-    void run() {
-        std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+
+    Task<void> search() {
+        std::cout << "Search for > ";
+        std::cout.flush();
+        std::string query = co_await readLine();
+        if (query.empty()) {
+            co_return;
+        }
+        // Where the next page starts, as the server gave it with the last page
+        std::string cursor = "";
+        bool firstPage = true;
+        while (true) {
+            std::string command = firstPage ? "search" : "search " + cursor;
+            Message message = co_await session.command(command, query);
+            receiveReply(message);
+            if (message.content.empty()) {
+                std::cout << (firstPage ? "No matching messages" : "No more results") << std::endl;
+                co_return;
+            }
+            // Each line is: id timestamp sender conversation message
+            std::stringstream ss(message.content);
+            std::string line;
+            TimestampFormatter formatter;
+            while (std::getline(ss, line)) {
+                std::stringstream result(line);
+                std::string id, sender, conversation, content;
+                int64_t timestamp = 0;
+                result >> id >> timestamp >> sender >> conversation;
+                std::getline(result, content);
+                std::string time;
+                formatter.append(time, timestamp);
+                std::cout << "(" << id << ") [" << time << "] " << conversation << " | " << sender << ":" << content << std::endl;
+            }
+            if (message.receiver.empty()) {
+                std::cout << "No more results" << std::endl;
+                co_return;
+            }
+            std::cout << "Type \"n\" for the next page, anything else to go back > ";
+            std::cout.flush();
+            std::string input = co_await readLine();
+            if (input != "n") {
+                co_return;
+            }
+            cursor = message.receiver;
+            firstPage = false;
+        }
+    }
+
+    // Fetch only what was sent to us since we last saw each conversation
+    Task<void> syncMissed() {
+        std::string known = "";
+        for (const auto& conversation : lastSeen) {
+            known += std::to_string(conversation.second) + " " + conversation.first + "\n";
+        }
+        Message message = co_await session.command("sync", known);
+        receiveReply(message);
+        if (message.content.empty()) {
+            co_return;
+        }
+
+        std::cout << "While you were away:" << std::endl;
+        std::unordered_map<std::string, int64_t> missed;
+        std::stringstream ss(message.content);
+        std::string line;
+        TimestampFormatter formatter;
+        while (std::getline(ss, line)) {
+            std::stringstream msg(line);
+            std::string sequence, sender, conversation, content;
+            int64_t timestamp = 0;
+            msg >> sequence >> timestamp >> sender >> conversation;
+            std::getline(msg, content);
+            missed[conversation] = std::max<int64_t>(missed[conversation], std::stoll(sequence));
+            std::string time;
+            formatter.append(time, timestamp);
+            std::cout << "[" << time << "] " << conversation << " | " << sender << ":" << content << std::endl;
+        }
+        for (const auto& conversation : missed) {
+            lastSeen[conversation.first] = std::max(lastSeen[conversation.first], conversation.second);
+            session.acknowledge(conversation.first == "#global" ? "" : conversation.first, "delivered", conversation.second);
+        }
+    }
+
+    Task<void> menu() {
         clearScreen();
         std::cout << "Welcome " << username << "!" << std::endl;
+        co_await syncMissed();
         printHelp();
         while (true) {
             std::cout << "> ";
-            std::string input;
-            std::getline(std::cin, input);
+            std::cout.flush();
+            std::string input = co_await readLine();
             if (commands.find(input) == commands.end()) {
                 std::cout << "Unknown command. Type \"h\" for help" << std::endl;
                 continue;
@@ -263,44 +529,50 @@ public:
             }
             else if (input == "q") {
                 std::cout << "Quitting chat client. Thanks for chatting!" << std::endl;
-                close(serverfd);
+                session.close();
                 exit(0);
             }
             else if (input == "logout") {
                 clearScreen();
-                return;
+                co_return;
             }
             else if (input == "whoami") {
                 std::cout << username << std::endl;
             }
             else if (input == "users") {
-                Message message {
-                    .type = Message::Type::COMMAND,
-                    .sender = "",
-                    .receiver = "",
-                    .content = "onlineUsers",
-                    .token = token,
-                    .timestamp = std::chrono::system_clock::now()
-                };
-                sendMessage(serverfd, message);
-                emptySocket(serverfd);
-                receiveMessage(serverfd, message);
+                Message message = co_await session.command("onlineUsers");
+                receiveReply(message);
                 std::cout << "Online users:" << std::endl;
                 std::cout << message.content;
             }
             else if (input == "chat") {
-                chatroom();
+                co_await chatroom();
             }
             else if (input == "global") {
-                chat("");
+                co_await chat("");
+            }
+            else if (input == "search") {
+                co_await search();
+            }
+            else if (input == "rooms") {
+                co_await roomsMenu();
             }
         }
     }
+
+    Task<void> run() {
+        co_await connect();
+        std::cout << "Welcome to chat client!" << std::endl;
+        while (true) {
+            co_await authenticate();
+            co_await menu();
+        }
+    }
 };
 
 int main(int argc, char *argv[]) {
-    if (argc != 3) {
-        std::cerr << "Usage: " << argv[0] << " <serverIP> <port>" << std::endl;
+    if (argc != 3 && !(argc == 5 && std::string(argv[3]) == "--tls")) {
+        std::cerr << "Usage: " << argv[0] << " <serverIP> <port> [--tls <CA certificate file>]" << std::endl;
         return 1;
     }
     try {
@@ -309,12 +581,10 @@ int main(int argc, char *argv[]) {
             std::cerr << "Invalid port number" << std::endl;
             return 1;
         }
-        ChatClient client(argv[1], port);
-        std::cout << "Welcome to chat client!" << std::endl;
-        while (true) {
-            client.authenticate();
-            client.run();
-        }
+        EventLoop loop;
+        ChatClient client(loop, argv[1], port, argc == 5 ? tlsClientContext(argv[4]) : nullptr);
+        loop.spawn(client.run());
+        loop.run();
     }
     catch (const std::exception &e) {
         std::cerr << "Error: " << e.what() << std::endl;
@@ -322,4 +592,4 @@ int main(int argc, char *argv[]) {
     }
 
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,462 @@
+#include "cluster.h"
+#include <fcntl.h>
+#include <netinet/tcp.h>
+#include <openssl/crypto.h>
+#include <cerrno>
+#include <cstring>
+
+// A peer that cannot keep up is disconnected rather than buffered without bound
+const size_t MAX_PEER_BACKLOG = 64 * 1024 * 1024;
+const int RECONNECT_SECONDS = 1;
+// Inbound links per peer: its current one and one left over from before it reconnected
+const size_t LINKS_PER_PEER = 2;
+
+namespace {
+
+bool parseAddress(const std::string& address, sockaddr_in& result) {
+    size_t colon = address.rfind(':');
+    if (colon == std::string::npos) {
+        return false;
+    }
+    int port = std::atoi(address.c_str() + colon + 1);
+    if (port <= 0 || port > 65535) {
+        return false;
+    }
+    result = {};
+    result.sin_family = AF_INET;
+    result.sin_port = htons(port);
+    result.sin_addr.s_addr = inet_addr(address.substr(0, colon).c_str());
+    return result.sin_addr.s_addr != INADDR_NONE;
+}
+
+void setNonBlocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+void appendInt(std::string& buffer, uint32_t value) {
+    value = htonl(value);
+    buffer.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+uint32_t readInt(const char* data) {
+    uint32_t value;
+    std::memcpy(&value, data, sizeof(value));
+    return ntohl(value);
+}
+
+// Read everything available on a non-blocking socket; false once the peer is gone
+bool drain(int fd, std::string& buffer) {
+    char chunk[16384];
+    while (true) {
+        ssize_t bytes = recv(fd, chunk, sizeof(chunk), 0);
+        if (bytes > 0) {
+            buffer.append(chunk, bytes);
+            continue;
+        }
+        if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return true;
+        }
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        return false;
+    }
+}
+
+}
+
+Cluster::Cluster(const std::string& nodeAddress, const std::vector<std::string>& peerAddresses, const std::string& secret, MessageHandler onMessage, MembershipHandler onMembership)
+    : nodeAddress(nodeAddress), secret(secret), onMessage(std::move(onMessage)), onMembership(std::move(onMembership)) {
+    sockaddr_in relayaddr;
+    if (!parseAddress(nodeAddress, relayaddr)) {
+        std::cerr << "Invalid node address " << nodeAddress << std::endl;
+        exit(1);
+    }
+    listenfd = socket(AF_INET, SOCK_STREAM, 0);
+    int optval = 1;
+    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+    if (bind(listenfd, (struct sockaddr*)&relayaddr, sizeof(relayaddr)) < 0 || listen(listenfd, 16) < 0) {
+        std::cerr << "Error listening on relay address " << nodeAddress << std::endl;
+        exit(1);
+    }
+    setNonBlocking(listenfd);
+    for (const auto& address : peerAddresses) {
+        sockaddr_in peeraddr;
+        if (!parseAddress(address, peeraddr)) {
+            std::cerr << "Invalid peer address " << address << std::endl;
+            exit(1);
+        }
+        peers.push_back({.address = address});
+        peerHosts.insert(peeraddr.sin_addr.s_addr);
+    }
+    std::cout << "Cluster node " << nodeAddress << " with " << peers.size() << " peers" << std::endl;
+}
+
+Cluster::~Cluster() {
+    for (auto& peer : peers) {
+        if (peer.fd >= 0) {
+            close(peer.fd);
+        }
+    }
+    for (auto& link : links) {
+        close(link.first);
+    }
+    close(listenfd);
+}
+
+void Cluster::addFds(fd_set& readfds, fd_set& writefds) const {
+    FD_SET(listenfd, &readfds);
+    for (const auto& link : links) {
+        FD_SET(link.first, &readfds);
+    }
+    for (const auto& peer : peers) {
+        if (peer.fd < 0) {
+            continue;
+        }
+        if (peer.connecting || !peer.output.empty()) {
+            FD_SET(peer.fd, &writefds);
+        }
+        // Outbound links never carry data back, this only notices the peer going away
+        FD_SET(peer.fd, &readfds);
+    }
+}
+
+void Cluster::handle(const fd_set& readfds, const fd_set& writefds) {
+    if (FD_ISSET(listenfd, &readfds)) {
+        while (true) {
+            sockaddr_in linkaddr;
+            socklen_t length = sizeof(linkaddr);
+            int linkfd = accept(listenfd, (struct sockaddr*)&linkaddr, &length);
+            if (linkfd < 0) {
+                break;
+            }
+            if (!peerHosts.count(linkaddr.sin_addr.s_addr) || links.size() >= LINKS_PER_PEER * peers.size()) {
+                std::cerr << "Refused relay link from " << inet_ntoa(linkaddr.sin_addr) << std::endl;
+                close(linkfd);
+                continue;
+            }
+            setNonBlocking(linkfd);
+            links[linkfd] = {};
+        }
+    }
+
+    std::vector<int> closed;
+    for (auto& link : links) {
+        if (FD_ISSET(link.first, &readfds)) {
+            bool open = drain(link.first, link.second.input);
+            bool introduced = !link.second.node.empty();
+            if (!processFrames(link.second) || !open) {
+                closed.push_back(link.first);
+            }
+            else if (!introduced && !link.second.node.empty()) {
+                // A peer only keeps one link to us, any other it has is stale
+                for (const auto& other : links) {
+                    if (other.first != link.first && other.second.node == link.second.node) {
+                        closed.push_back(other.first);
+                    }
+                }
+            }
+        }
+    }
+    for (int linkfd : closed) {
+        dropLink(linkfd);
+    }
+
+    for (auto& peer : peers) {
+        if (peer.fd < 0) {
+            continue;
+        }
+        if (peer.connecting && FD_ISSET(peer.fd, &writefds)) {
+            int error = 0;
+            socklen_t length = sizeof(error);
+            getsockopt(peer.fd, SOL_SOCKET, SO_ERROR, &error, &length);
+            if (error != 0) {
+                dropPeer(peer);
+                continue;
+            }
+            std::cout << "Relay link to " << peer.address << " established" << std::endl;
+            peer.connecting = false;
+            // Introduce ourselves and replace whatever the peer knew about our users
+            std::vector<std::string> users;
+            for (const auto& user : localUsers) {
+                users.push_back(user.first);
+            }
+            queue(peer, Frame::HELLO, {nodeAddress, secret});
+            queue(peer, Frame::SNAPSHOT, users);
+        }
+        else if (!peer.connecting && FD_ISSET(peer.fd, &readfds)) {
+            std::string ignored;
+            if (!drain(peer.fd, ignored)) {
+                dropPeer(peer);
+            }
+        }
+    }
+}
+
+void Cluster::flush() {
+    time_t now = time(NULL);
+    for (auto& peer : peers) {
+        if (peer.fd < 0) {
+            if (now >= peer.nextAttempt) {
+                connectPeer(peer);
+            }
+            continue;
+        }
+        if (peer.connecting || peer.output.empty()) {
+            continue;
+        }
+        ssize_t sent = send(peer.fd, peer.output.data(), peer.output.size(), MSG_NOSIGNAL);
+        if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            dropPeer(peer);
+            continue;
+        }
+        if (sent > 0) {
+            peer.output.erase(0, sent);
+        }
+        if (peer.output.size() > MAX_PEER_BACKLOG) {
+            std::cerr << "Relay link to " << peer.address << " is too far behind" << std::endl;
+            dropPeer(peer);
+        }
+    }
+}
+
+bool Cluster::pending() const {
+    for (const auto& peer : peers) {
+        if (!peer.output.empty()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void Cluster::userOnline(const std::string& username) {
+    if (++localUsers[username] == 1) {
+        queueAll(Frame::ONLINE, {username});
+    }
+}
+
+void Cluster::userOffline(const std::string& username) {
+    auto user = localUsers.find(username);
+    if (user == localUsers.end()) {
+        return;
+    }
+    if (--user->second == 0) {
+        localUsers.erase(user);
+        queueAll(Frame::OFFLINE, {username});
+    }
+}
+
+void Cluster::relay(const Message& message) {
+    std::vector<std::string> fields = {
+        std::to_string(static_cast<int32_t>(message.type)),
+        message.sender,
+        message.receiver,
+        message.content,
+        timePointToString(message.timestamp),
+        std::to_string(message.sequence)
+    };
+    if (message.receiver.empty() || isRoom(message.receiver)) {
+        // Room membership lives in the shared database, every node fans out to its own members
+        queueAll(Frame::MESSAGE, fields);
+        return;
+    }
+    auto nodes = presence.find(message.receiver);
+    if (nodes == presence.end()) {
+        return;
+    }
+    for (auto& peer : peers) {
+        if (nodes->second.count(peer.address)) {
+            queue(peer, Frame::MESSAGE, fields);
+        }
+    }
+}
+
+void Cluster::relayMembership(const std::string& username, const std::string& room, bool joined) {
+    auto nodes = presence.find(username);
+    if (nodes == presence.end()) {
+        return;
+    }
+    for (auto& peer : peers) {
+        if (nodes->second.count(peer.address)) {
+            queue(peer, Frame::MEMBERSHIP, {username, room, joined ? "1" : "0"});
+        }
+    }
+}
+
+std::set<std::string> Cluster::remoteUsers() const {
+    std::set<std::string> users;
+    for (const auto& user : presence) {
+        users.insert(user.first);
+    }
+    return users;
+}
+
+void Cluster::connectPeer(Peer& peer) {
+    sockaddr_in peeraddr;
+    parseAddress(peer.address, peeraddr);
+    peer.fd = socket(AF_INET, SOCK_STREAM, 0);
+    setNonBlocking(peer.fd);
+    // Leave from our own host, which is what the peer takes links from
+    sockaddr_in localaddr;
+    parseAddress(nodeAddress, localaddr);
+    localaddr.sin_port = 0;
+    bind(peer.fd, (struct sockaddr*)&localaddr, sizeof(localaddr));
+    int optval = 1;
+    setsockopt(peer.fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+    if (connect(peer.fd, (struct sockaddr*)&peeraddr, sizeof(peeraddr)) < 0 && errno != EINPROGRESS) {
+        dropPeer(peer);
+        return;
+    }
+    peer.connecting = true;
+}
+
+void Cluster::dropPeer(Peer& peer) {
+    if (!peer.connecting) {
+        std::cerr << "Relay link to " << peer.address << " lost" << std::endl;
+    }
+    close(peer.fd);
+    peer.fd = -1;
+    peer.connecting = false;
+    peer.output.clear();
+    peer.nextAttempt = time(NULL) + RECONNECT_SECONDS;
+}
+
+void Cluster::dropLink(int fd) {
+    auto dropped = links.find(fd);
+    if (dropped == links.end()) {
+        return;
+    }
+    std::string node = dropped->second.node;
+    close(fd);
+    links.erase(dropped);
+    for (const auto& link : links) {
+        if (link.second.node == node) {
+            // The node already reconnected and sent a fresh snapshot
+            return;
+        }
+    }
+    for (auto it = presence.begin(); it != presence.end(); ) {
+        it->second.erase(node);
+        it = it->second.empty() ? presence.erase(it) : std::next(it);
+    }
+}
+
+// Frame layout: body length, frame type, then every field as length + bytes
+void Cluster::queue(Peer& peer, Frame frame, const std::vector<std::string>& fields) {
+    if (peer.fd < 0 || peer.connecting) {
+        // The snapshot sent on connect brings the peer up to date
+        return;
+    }
+    uint32_t length = 1;
+    for (const auto& field : fields) {
+        length += sizeof(uint32_t) + field.size();
+    }
+    appendInt(peer.output, length);
+    peer.output.push_back(static_cast<char>(frame));
+    for (const auto& field : fields) {
+        appendInt(peer.output, field.size());
+        peer.output += field;
+    }
+}
+
+void Cluster::queueAll(Frame frame, const std::vector<std::string>& fields) {
+    for (auto& peer : peers) {
+        queue(peer, frame, fields);
+    }
+}
+
+bool Cluster::isPeer(const std::string& address) const {
+    for (const auto& peer : peers) {
+        if (peer.address == address) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool Cluster::processFrames(Link& link) {
+    size_t position = 0;
+    while (link.input.size() - position >= sizeof(uint32_t)) {
+        uint32_t length = readInt(link.input.data() + position);
+        if (length == 0 || length > MAX_PEER_BACKLOG) {
+            return false;
+        }
+        if (link.input.size() - position - sizeof(uint32_t) < length) {
+            break;
+        }
+        const char* body = link.input.data() + position + sizeof(uint32_t);
+        position += sizeof(uint32_t) + length;
+
+        Frame frame = static_cast<Frame>(body[0]);
+        std::vector<std::string> fields;
+        size_t offset = 1;
+        while (offset < length) {
+            if (length - offset < sizeof(uint32_t)) {
+                return false;
+            }
+            uint32_t size = readInt(body + offset);
+            offset += sizeof(uint32_t);
+            if (length - offset < size) {
+                return false;
+            }
+            fields.emplace_back(body + offset, size);
+            offset += size;
+        }
+
+        if (frame == Frame::HELLO) {
+            bool trusted = link.node.empty() && fields.size() == 2 && isPeer(fields[0]) &&
+                fields[1].size() == secret.size() && CRYPTO_memcmp(fields[1].data(), secret.data(), secret.size()) == 0;
+            if (!trusted) {
+                std::cerr << "Relay link failed to authenticate" << std::endl;
+                return false;
+            }
+            link.node = fields[0];
+            std::cout << "Relay link from " << link.node << " established" << std::endl;
+        }
+        else if (link.node.empty()) {
+            return false;
+        }
+        else if (frame == Frame::SNAPSHOT) {
+            for (auto it = presence.begin(); it != presence.end(); ) {
+                it->second.erase(link.node);
+                it = it->second.empty() ? presence.erase(it) : std::next(it);
+            }
+            for (const auto& user : fields) {
+                presence[user].insert(link.node);
+            }
+        }
+        else if (frame == Frame::ONLINE && fields.size() == 1) {
+            presence[fields[0]].insert(link.node);
+        }
+        else if (frame == Frame::OFFLINE && fields.size() == 1) {
+            auto user = presence.find(fields[0]);
+            if (user != presence.end()) {
+                user->second.erase(link.node);
+                if (user->second.empty()) {
+                    presence.erase(user);
+                }
+            }
+        }
+        else if (frame == Frame::MESSAGE && fields.size() == 6) {
+            Message message {
+                .type = static_cast<Message::Type>(std::atoi(fields[0].c_str())),
+                .sender = fields[1],
+                .receiver = fields[2],
+                .content = fields[3],
+                .token = "",
+                .timestamp = intToTimePoint(std::atoi(fields[4].c_str())),
+                .sequence = std::atoll(fields[5].c_str())
+            };
+            onMessage(message);
+        }
+        else if (frame == Frame::MEMBERSHIP && fields.size() == 3) {
+            onMembership(fields[0], fields[1], fields[2] == "1");
+        }
+        else {
+            return false;
+        }
+    }
+    link.input.erase(0, position);
+    return true;
+}
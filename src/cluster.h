@@ -0,0 +1,98 @@
+#pragma once
+#include <sys/select.h>
+#include <ctime>
+#include <functional>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "utils.h"
+
+// Relay between several ChatServer nodes.
+//
+// Every node listens on its relay address and keeps one persistent outbound
+// link to every peer, so each link only ever carries traffic one way. Nodes
+// announce which users are connected to them and forward CHAT and ACK messages
+// to the nodes where the receiver is online (global messages go to every node).
+// Room joins and leaves go to the nodes where the member is online, so all of
+// its sessions follow the membership.
+// Frames are queued per link and written once per event loop round.
+//
+// The relay listens on the host of this node's address only and takes links
+// from the hosts of its peers only, at most two per peer (a reconnecting peer's
+// old link may not be gone yet). A link is only trusted once its HELLO names
+// one of the peers and carries the cluster's shared secret.
+class Cluster {
+public:
+    using MessageHandler = std::function<void(const Message& message)>;
+    using MembershipHandler = std::function<void(const std::string& username, const std::string& room, bool joined)>;
+
+    // nodeAddress is host:port of this node's relay listener, exactly as the
+    // other nodes list it in their peers; every node has the same secret
+    Cluster(const std::string& nodeAddress, const std::vector<std::string>& peerAddresses, const std::string& secret, MessageHandler onMessage, MembershipHandler onMembership);
+    ~Cluster();
+
+    // Register the relay sockets with the server's select call
+    void addFds(fd_set& readfds, fd_set& writefds) const;
+    // Accept, read and finish connecting whatever select reported
+    void handle(const fd_set& readfds, const fd_set& writefds);
+    // Write queued frames and retry dropped links
+    void flush();
+    // True when frames are queued for flush()
+    bool pending() const;
+
+    // Track local sessions; only the first login and last logout are announced
+    void userOnline(const std::string& username);
+    void userOffline(const std::string& username);
+
+    // Forward a message that was received from a local client
+    void relay(const Message& message);
+    // Tell the nodes where the user is also connected that it joined or left a room
+    void relayMembership(const std::string& username, const std::string& room, bool joined);
+    // Users connected to other nodes
+    std::set<std::string> remoteUsers() const;
+
+private:
+    enum class Frame : uint8_t {
+        HELLO,
+        SNAPSHOT,
+        ONLINE,
+        OFFLINE,
+        MESSAGE,
+        MEMBERSHIP,
+    };
+    struct Peer {
+        std::string address;
+        int fd = -1;
+        bool connecting = false;
+        time_t nextAttempt = 0;
+        std::string output;
+    };
+    struct Link {
+        std::string node;
+        std::string input;
+    };
+
+    void connectPeer(Peer& peer);
+    void dropPeer(Peer& peer);
+    void dropLink(int fd);
+    void queue(Peer& peer, Frame frame, const std::vector<std::string>& fields);
+    void queueAll(Frame frame, const std::vector<std::string>& fields);
+    bool processFrames(Link& link);
+
+    bool isPeer(const std::string& address) const;
+
+    std::string nodeAddress;
+    std::string secret;
+    int listenfd;
+    // Hosts of the peers, the only ones links are accepted from
+    std::set<in_addr_t> peerHosts;
+    std::vector<Peer> peers;
+    std::unordered_map<int, Link> links;
+    MessageHandler onMessage;
+    MembershipHandler onMembership;
+    // Local username to number of sessions on this node
+    std::unordered_map<std::string, int> localUsers;
+    // Remote username to the nodes it is connected to
+    std::unordered_map<std::string, std::set<std::string>> presence;
+};
@@ -0,0 +1,114 @@
+#pragma once
+#include <string>
+#include <iostream>
+#include <sqlite3.h>
+
+const std::string DATABASE = "../var/database.sqlite3";
+// How long a statement waits for another connection (e.g. another cluster
+// node) to release the database before failing with SQLITE_BUSY
+const int BUSY_TIMEOUT_MS = 5000;
+
+class Database {
+public:
+    explicit Database(const std::string& path = DATABASE) {
+        if (sqlite3_open(path.c_str(), &db) != SQLITE_OK) {
+            std::cerr << "Error opening database" << std::endl;
+            exit(1);
+        }
+        sqlite3_busy_timeout(db, BUSY_TIMEOUT_MS);
+    }
+
+    ~Database() {
+        if (db) {
+            sqlite3_close(db);
+        }
+    }
+
+    sqlite3* get() {
+        return db;
+    }
+private:
+    sqlite3* db;
+};
+
+class Statement {
+public:
+    Statement(sqlite3* db, const std::string& sql) {
+        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, NULL) != SQLITE_OK) {
+            std::cerr << "Error creating statement" << std::endl;
+            exit(1);
+        }
+    }
+
+    ~Statement() {
+        if (stmt) {
+            sqlite3_finalize(stmt);
+        }
+    }
+
+    void bindText(int index, const std::string& value) {
+        if (sqlite3_bind_text(stmt, index, value.c_str(), -1, SQLITE_TRANSIENT) != SQLITE_OK) {
+            std::cerr << "Error binding text" << std::endl;
+            exit(1);
+        }
+    }
+
+    void bindInt(int index, int value) {
+        if (sqlite3_bind_int(stmt, index, value) != SQLITE_OK) {
+            std::cerr << "Error binding integer" << std::endl;
+            exit(1);
+        }
+    }
+
+    void bindInt64(int index, int64_t value) {
+        if (sqlite3_bind_int64(stmt, index, value) != SQLITE_OK) {
+            std::cerr << "Error binding integer" << std::endl;
+            exit(1);
+        }
+    }
+
+    void bindDouble(int index, double value) {
+        if (sqlite3_bind_double(stmt, index, value) != SQLITE_OK) {
+            std::cerr << "Error binding double" << std::endl;
+            exit(1);
+        }
+    }
+
+    void clearBindings() {
+        if (sqlite3_clear_bindings(stmt) != SQLITE_OK) {
+            std::cerr << "Error clearing bindings" << std::endl;
+            exit(1);
+        }
+    }
+
+    void reset() {
+        if (sqlite3_reset(stmt) != SQLITE_OK) {
+            std::cerr << "Error resetting statement" << std::endl;
+            exit(1);
+        }
+    }
+
+    bool step() {
+        return sqlite3_step(stmt) == SQLITE_ROW;
+    }
+
+    const char* getColumnText(int columnIndex) {
+        return reinterpret_cast<const char*>(sqlite3_column_text(stmt, columnIndex));
+    }
+
+    sqlite3_stmt* get() {
+        return stmt;
+    }
+private:
+    sqlite3_stmt* stmt;
+};
+
+// Id of the user with this name, -1 if there is none
+inline int userID(Database& db, const std::string& username) {
+    Statement stmt(db.get(), "SELECT id FROM users WHERE username = ?");
+    stmt.bindText(1, username);
+    if (stmt.step()) {
+        return sqlite3_column_int(stmt.get(), 0);
+    }
+    return -1;
+}
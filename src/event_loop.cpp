@@ -0,0 +1,163 @@
+#include "event_loop.h"
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <cerrno>
+#include <csignal>
+#include <iostream>
+
+// Events handled per epoll_wait
+const int EVENTS_PER_ROUND = 256;
+
+// Runs a spawned task and frees itself when it is done, nobody awaits it
+struct EventLoop::Detached {
+    struct promise_type {
+        Detached get_return_object() {
+            return {};
+        }
+        std::suspend_never initial_suspend() noexcept {
+            return {};
+        }
+        std::suspend_never final_suspend() noexcept {
+            return {};
+        }
+        void return_void() {}
+        void unhandled_exception() {
+            std::terminate();
+        }
+    };
+};
+
+void EventLoop::FdAwaiter::await_suspend(std::coroutine_handle<> handle) {
+    waiting = handle;
+    if (!loop.watch(fd, this, events | EPOLLONESHOT)) {
+        fired = events;
+        loop.post(waiting);
+    }
+}
+
+void EventLoop::FdAwaiter::ready(uint32_t events) {
+    fired = events;
+    loop.unwatch(fd);
+    loop.post(waiting);
+}
+
+void EventLoop::SleepAwaiter::await_suspend(std::coroutine_handle<> handle) {
+    uint32_t id;
+    if (loop.freeTimers.empty()) {
+        id = loop.sleepers.size();
+        loop.sleepers.push_back(handle);
+    }
+    else {
+        id = loop.freeTimers.back();
+        loop.freeTimers.pop_back();
+        loop.sleepers[id] = handle;
+    }
+    loop.timers.schedule(id, delayMs);
+}
+
+EventLoop::EventLoop() {
+    epollfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollfd < 0) {
+        std::cerr << "Error creating epoll instance" << std::endl;
+        exit(1);
+    }
+    // A server hanging up shows up as a failed write on that session, not a signal
+    signal(SIGPIPE, SIG_IGN);
+}
+
+EventLoop::~EventLoop() {
+    close(epollfd);
+}
+
+EventLoop::Detached EventLoop::detach(Task<void> task) {
+    try {
+        co_await task;
+    }
+    catch (const std::exception& e) {
+        std::cerr << "Task failed: " << e.what() << std::endl;
+    }
+    tasks--;
+}
+
+void EventLoop::spawn(Task<void> task) {
+    tasks++;
+    detach(std::move(task));
+}
+
+void EventLoop::run() {
+    stopped = false;
+    epoll_event events[EVENTS_PER_ROUND];
+    while (true) {
+        resumeReady();
+        if (stopped || tasks == 0) {
+            return;
+        }
+        int count = epoll_wait(epollfd, events, EVENTS_PER_ROUND, timers.millisecondsUntilNext());
+        if (count < 0 && errno != EINTR) {
+            std::cerr << "Error waiting for events" << std::endl;
+            exit(1);
+        }
+        for (int i = 0; i < count; i++) {
+            static_cast<Watcher*>(events[i].data.ptr)->ready(events[i].events);
+        }
+        timers.advance([this](uint32_t id) {
+            post(sleepers[id]);
+            sleepers[id] = nullptr;
+            freeTimers.push_back(id);
+        });
+    }
+}
+
+void EventLoop::stop() {
+    stopped = true;
+}
+
+EventLoop::FdAwaiter EventLoop::readable(int fd) {
+    return FdAwaiter(*this, fd, EPOLLIN);
+}
+
+EventLoop::FdAwaiter EventLoop::writable(int fd) {
+    return FdAwaiter(*this, fd, EPOLLOUT);
+}
+
+EventLoop::SleepAwaiter EventLoop::sleep(uint32_t delayMs) {
+    return SleepAwaiter(*this, delayMs);
+}
+
+void EventLoop::post(std::coroutine_handle<> handle) {
+    readyQueue.push_back(handle);
+}
+
+bool EventLoop::watch(int fd, Watcher* watcher, uint32_t events) {
+    epoll_event event;
+    event.events = events;
+    event.data.ptr = watcher;
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event) == 0) {
+        return true;
+    }
+    if (errno == EEXIST && epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &event) == 0) {
+        return true;
+    }
+    if (errno == EPERM) {
+        return false;
+    }
+    std::cerr << "Error watching " << fd << std::endl;
+    exit(1);
+}
+
+void EventLoop::unwatch(int fd) {
+    epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, nullptr);
+}
+
+// Coroutines resumed here may post more, e.g. a reply they wrote was answered
+// from a buffer; those run in the same round
+void EventLoop::resumeReady() {
+    std::vector<std::coroutine_handle<>> batch;
+    while (!readyQueue.empty()) {
+        batch.swap(readyQueue);
+        for (std::coroutine_handle<> handle : batch) {
+            handle.resume();
+        }
+        batch.clear();
+    }
+}
@@ -0,0 +1,101 @@
+#pragma once
+#include <coroutine>
+#include <cstdint>
+#include <vector>
+#include "task.h"
+#include "timer_wheel.h"
+
+// Told when a file descriptor it watches with EventLoop::watch is ready.
+// Watchers only record what happened and post() the coroutines that were
+// waiting for it; those run after every event of the round has been seen.
+class Watcher {
+public:
+    virtual ~Watcher() = default;
+    // events holds the EPOLLIN/EPOLLOUT/EPOLLERR/EPOLLHUP bits that fired
+    virtual void ready(uint32_t events) = 0;
+};
+
+// Single threaded loop that runs coroutines (Task<void>) until they wait for
+// a socket or a timer. One loop drives any number of chat sessions, so a bot
+// host needs a single thread however many accounts it runs. It is built on
+// epoll rather than select, which stops at FD_SETSIZE descriptors and costs
+// a scan of every one of them per round.
+class EventLoop {
+public:
+    // co_await loop.readable(fd) / loop.writable(fd), resumes with the epoll
+    // events that fired. fd must not be watched by anything else meanwhile.
+    class FdAwaiter : private Watcher {
+    public:
+        FdAwaiter(EventLoop& loop, int fd, uint32_t events) : loop(loop), fd(fd), events(events) {}
+        bool await_ready() const noexcept {
+            return false;
+        }
+        void await_suspend(std::coroutine_handle<> handle);
+        uint32_t await_resume() const noexcept {
+            return fired;
+        }
+    private:
+        void ready(uint32_t events) override;
+
+        EventLoop& loop;
+        int fd;
+        uint32_t events;
+        uint32_t fired = 0;
+        std::coroutine_handle<> waiting;
+    };
+
+    // co_await loop.sleep(ms)
+    class SleepAwaiter {
+    public:
+        SleepAwaiter(EventLoop& loop, uint32_t delayMs) : loop(loop), delayMs(delayMs) {}
+        bool await_ready() const noexcept {
+            return false;
+        }
+        void await_suspend(std::coroutine_handle<> handle);
+        void await_resume() const noexcept {}
+    private:
+        EventLoop& loop;
+        uint32_t delayMs;
+    };
+
+    EventLoop();
+    ~EventLoop();
+    EventLoop(const EventLoop&) = delete;
+    EventLoop& operator=(const EventLoop&) = delete;
+
+    // Start task right away; it runs until it first has to wait, the loop
+    // takes it from there. An exception escaping it is reported on stderr.
+    void spawn(Task<void> task);
+
+    // Run until every spawned task has finished or stop() is called
+    void run();
+    void stop();
+
+    FdAwaiter readable(int fd);
+    FdAwaiter writable(int fd);
+    SleepAwaiter sleep(uint32_t delayMs);
+
+    // Resume handle once the events of the current round have been dispatched
+    void post(std::coroutine_handle<> handle);
+
+    // Tell watcher about events (EPOLLIN/EPOLLOUT, optionally EPOLLONESHOT)
+    // on fd until unwatch; watching a watched fd changes its events. False
+    // for a regular file, which epoll refuses because it is always ready.
+    bool watch(int fd, Watcher* watcher, uint32_t events);
+    void unwatch(int fd);
+
+private:
+    struct Detached;
+    Detached detach(Task<void> task);
+    void resumeReady();
+
+    int epollfd;
+    TimerWheel timers;
+    // Sleeping coroutines by timer id, and ids that are free again
+    std::vector<std::coroutine_handle<>> sleepers;
+    std::vector<uint32_t> freeTimers;
+    std::vector<std::coroutine_handle<>> readyQueue;
+    // Spawned tasks still running
+    size_t tasks = 0;
+    bool stopped = false;
+};
@@ -0,0 +1,269 @@
+#include "handoff.h"
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+// Descriptors are passed in batches below the kernel's SCM_MAX_FD limit
+const size_t FDS_PER_MESSAGE = 250;
+
+namespace {
+
+bool unixAddress(const std::string& path, sockaddr_un& address) {
+    address = {};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        std::cerr << "Handoff socket path too long: " << path << std::endl;
+        return false;
+    }
+    std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+    return true;
+}
+
+// Whoever is on the other end of the handoff socket gets or gives every client
+// connection, so it has to be a server run by the same user
+bool sameUser(int connfd) {
+    ucred credentials;
+    socklen_t length = sizeof(credentials);
+    if (getsockopt(connfd, SOL_SOCKET, SO_PEERCRED, &credentials, &length) < 0) {
+        return false;
+    }
+    return credentials.uid == getuid();
+}
+
+bool writeAll(int fd, const char* data, size_t size) {
+    while (size > 0) {
+        ssize_t written = write(fd, data, size);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return false;
+        }
+        data += written;
+        size -= written;
+    }
+    return true;
+}
+
+bool readAll(int fd, char* data, size_t size) {
+    while (size > 0) {
+        ssize_t bytes = read(fd, data, size);
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes <= 0) {
+            return false;
+        }
+        data += bytes;
+        size -= bytes;
+    }
+    return true;
+}
+
+void appendInt(std::string& buffer, uint32_t value) {
+    buffer.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void appendString(std::string& buffer, const std::string& value) {
+    appendInt(buffer, value.size());
+    buffer += value;
+}
+
+bool readInt(const std::string& buffer, size_t& position, uint32_t& value) {
+    if (buffer.size() - position < sizeof(value)) {
+        return false;
+    }
+    std::memcpy(&value, buffer.data() + position, sizeof(value));
+    position += sizeof(value);
+    return true;
+}
+
+bool readString(const std::string& buffer, size_t& position, std::string& value) {
+    uint32_t size;
+    if (!readInt(buffer, position, size) || buffer.size() - position < size) {
+        return false;
+    }
+    value = buffer.substr(position, size);
+    position += size;
+    return true;
+}
+
+}
+
+bool receiveHandoff(const std::string& path, HandoffState& state) {
+    sockaddr_un address;
+    if (!unixAddress(path, address)) {
+        return false;
+    }
+    int connfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (connect(connfd, (struct sockaddr*)&address, sizeof(address)) < 0) {
+        // Nothing running (or a stale socket file), start from scratch
+        close(connfd);
+        return false;
+    }
+    if (!sameUser(connfd)) {
+        std::cerr << "The handoff socket " << path << " belongs to another user" << std::endl;
+        exit(1);
+    }
+    std::cout << "Taking over from the server on " << path << std::endl;
+
+    // Session state: count, last connection id, then per session username, token,
+    // rooms, idle time, pong flag, unhandled input, unsent output and connection id
+    uint32_t size;
+    std::string buffer;
+    if (!readAll(connfd, reinterpret_cast<char*>(&size), sizeof(size))) {
+        std::cerr << "Error receiving handoff state" << std::endl;
+        exit(1);
+    }
+    buffer.resize(size);
+    if (!readAll(connfd, &buffer[0], size)) {
+        std::cerr << "Error receiving handoff state" << std::endl;
+        exit(1);
+    }
+    size_t position = 0;
+    uint32_t count;
+    bool valid = readInt(buffer, position, count) && readInt(buffer, position, state.connections);
+    for (uint32_t i = 0; valid && i < count; i++) {
+        HandoffSession session = {};
+        uint32_t roomCount = 0;
+        uint32_t awaitingPong = 0;
+        valid = readString(buffer, position, session.username) && readString(buffer, position, session.token) && readInt(buffer, position, roomCount);
+        for (uint32_t j = 0; valid && j < roomCount; j++) {
+            std::string room;
+            valid = readString(buffer, position, room);
+            session.rooms.push_back(room);
+        }
+        valid = valid && readInt(buffer, position, session.idleMs) && readInt(buffer, position, awaitingPong) && readString(buffer, position, session.input) && readString(buffer, position, session.output) &&
+            readInt(buffer, position, session.connection);
+        if (!valid) {
+            break;
+        }
+        session.awaitingPong = awaitingPong != 0;
+        state.sessions.push_back(session);
+    }
+    if (!valid) {
+        std::cerr << "Malformed handoff state" << std::endl;
+        exit(1);
+    }
+
+    // Then the listening socket followed by one descriptor per session
+    std::vector<int> fds;
+    while (fds.size() < count + 1) {
+        char byte;
+        iovec iov = {&byte, 1};
+        char control[CMSG_SPACE(FDS_PER_MESSAGE * sizeof(int))];
+        msghdr msg = {};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(connfd, &msg, MSG_CMSG_CLOEXEC) <= 0) {
+            std::cerr << "Error receiving handoff descriptors" << std::endl;
+            exit(1);
+        }
+        for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+                size_t received = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                const int* data = reinterpret_cast<const int*>(CMSG_DATA(cmsg));
+                fds.insert(fds.end(), data, data + received);
+            }
+        }
+    }
+    state.listenfd = fds[0];
+    for (uint32_t i = 0; i < count; i++) {
+        state.sessions[i].fd = fds[i + 1];
+    }
+
+    // The old server closes its end when it exits, after letting go of its ports and files
+    char byte;
+    while (read(connfd, &byte, 1) > 0) {
+    }
+    close(connfd);
+    std::cout << "Took over " << count << " connections" << std::endl;
+    return true;
+}
+
+int listenForHandoff(const std::string& path) {
+    sockaddr_un address;
+    if (!unixAddress(path, address)) {
+        exit(1);
+    }
+    unlink(path.c_str());
+    int listenfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    // Created private to begin with, there is no moment anyone else could connect
+    mode_t mask = umask(0077);
+    int bound = bind(listenfd, (struct sockaddr*)&address, sizeof(address));
+    umask(mask);
+    if (bound < 0 || listen(listenfd, 1) < 0) {
+        std::cerr << "Error listening on handoff socket " << path << std::endl;
+        exit(1);
+    }
+    return listenfd;
+}
+
+int acceptHandoff(int listenfd) {
+    int connfd = accept(listenfd, NULL, NULL);
+    if (connfd < 0) {
+        std::cerr << "Error in accept" << std::endl;
+        return -1;
+    }
+    if (!sameUser(connfd)) {
+        std::cerr << "Refusing handoff to a process of another user" << std::endl;
+        close(connfd);
+        return -1;
+    }
+    return connfd;
+}
+
+bool sendHandoff(int connfd, const HandoffState& state) {
+    std::string buffer;
+    appendInt(buffer, state.sessions.size());
+    appendInt(buffer, state.connections);
+    for (const auto& session : state.sessions) {
+        appendString(buffer, session.username);
+        appendString(buffer, session.token);
+        appendInt(buffer, session.rooms.size());
+        for (const auto& room : session.rooms) {
+            appendString(buffer, room);
+        }
+        appendInt(buffer, session.idleMs);
+        appendInt(buffer, session.awaitingPong ? 1 : 0);
+        appendString(buffer, session.input);
+        appendString(buffer, session.output);
+        appendInt(buffer, session.connection);
+    }
+    uint32_t size = buffer.size();
+    if (!writeAll(connfd, reinterpret_cast<const char*>(&size), sizeof(size)) || !writeAll(connfd, buffer.data(), buffer.size())) {
+        return false;
+    }
+
+    std::vector<int> fds = {state.listenfd};
+    for (const auto& session : state.sessions) {
+        fds.push_back(session.fd);
+    }
+    for (size_t start = 0; start < fds.size(); start += FDS_PER_MESSAGE) {
+        size_t batch = std::min(FDS_PER_MESSAGE, fds.size() - start);
+        char byte = 0;
+        iovec iov = {&byte, 1};
+        char control[CMSG_SPACE(FDS_PER_MESSAGE * sizeof(int))] = {};
+        msghdr msg = {};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(batch * sizeof(int));
+        cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(batch * sizeof(int));
+        std::memcpy(CMSG_DATA(cmsg), fds.data() + start, batch * sizeof(int));
+        if (sendmsg(connfd, &msg, 0) < 0) {
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,45 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Hot restart: a running server listens on a Unix socket, and a new server
+// started with the same path connects to it and takes over the listening
+// socket and every client connection (passed with SCM_RIGHTS) together with
+// their sessions. The old server exits once everything has been sent, so
+// clients never notice and never have to log in again.
+//
+// Bytes a session has read but not handled yet, such as the start of a
+// message, go along with it, and so does output its socket has not taken
+// yet; anything unread is still in the socket.
+struct HandoffSession {
+    int fd;
+    std::string username;
+    std::string token;
+    std::vector<std::string> rooms;
+    uint32_t idleMs;
+    bool awaitingPong;
+    std::string input;
+    std::string output;
+    uint32_t connection; // Id in the capture, which the new server carries on
+};
+
+struct HandoffState {
+    int listenfd = -1;
+    uint32_t connections = 0; // Last connection id given out
+    std::vector<HandoffSession> sessions;
+};
+
+// New server: take over from the server listening on path. Returns false when
+// there is nobody to take over from. Only returns once the old server is gone.
+bool receiveHandoff(const std::string& path, HandoffState& state);
+
+// Old server: accept takeover requests on path. The socket is only accessible
+// to its owner, and both ends check that the other runs as the same user.
+int listenForHandoff(const std::string& path);
+
+// Old server: accept a takeover request, -1 if it failed or came from another user
+int acceptHandoff(int listenfd);
+
+// Old server: send everything to the new server connected on connfd
+bool sendHandoff(int connfd, const HandoffState& state);
@@ -0,0 +1,74 @@
+#include "history_cache.h"
+#include "utils.h"
+
+HistoryCache::HistoryCache(const std::string& path) : db(path) {
+    sqlite3_exec(db.get(), "PRAGMA journal_mode = WAL;"
+        "PRAGMA synchronous = NORMAL;"
+        "CREATE TABLE IF NOT EXISTS messages ("
+        "conversation TEXT NOT NULL, "
+        "seq INTEGER NOT NULL, "
+        "timestamp INTEGER NOT NULL, "
+        "sender TEXT NOT NULL, "
+        "message TEXT NOT NULL, "
+        "PRIMARY KEY (conversation, seq)) WITHOUT ROWID;", NULL, NULL, NULL);
+}
+
+int64_t HistoryCache::highWater(const std::string& conversation) {
+    Statement stmt(db.get(), "SELECT COALESCE(MAX(seq), 0) FROM messages WHERE conversation = ?;");
+    stmt.bindText(1, conversation);
+    return stmt.step() ? sqlite3_column_int64(stmt.get(), 0) : 0;
+}
+
+std::vector<std::pair<std::string, int64_t>> HistoryCache::highWaters() {
+    std::vector<std::pair<std::string, int64_t>> result;
+    Statement stmt(db.get(), "SELECT conversation, MAX(seq) FROM messages GROUP BY conversation;");
+    while (stmt.step()) {
+        result.emplace_back(stmt.getColumnText(0), sqlite3_column_int64(stmt.get(), 1));
+    }
+    return result;
+}
+
+size_t HistoryCache::store(const std::string& conversation, const std::string& history) {
+    Statement stmt(db.get(), "INSERT OR IGNORE INTO messages (conversation, seq, timestamp, sender, message) VALUES (?, ?, ?, ?, ?);");
+    stmt.bindText(1, conversation);
+    sqlite3_exec(db.get(), "BEGIN;", NULL, NULL, NULL);
+    size_t count = 0;
+    std::string_view rest = history;
+    while (!rest.empty()) {
+        size_t end = rest.find('\n');
+        std::string_view line = rest.substr(0, end);
+        rest = end == std::string_view::npos ? std::string_view() : rest.substr(end + 1);
+
+        int64_t sequence = 0;
+        int64_t timestamp = 0;
+        std::string_view sender;
+        std::string_view content;
+        if (!parseHistoryLine(line, sequence, timestamp, sender, content)) {
+            continue;
+        }
+
+        sqlite3_bind_int64(stmt.get(), 2, sequence);
+        sqlite3_bind_int64(stmt.get(), 3, timestamp);
+        sqlite3_bind_text(stmt.get(), 4, sender.data(), sender.size(), SQLITE_STATIC);
+        sqlite3_bind_text(stmt.get(), 5, content.data(), content.size(), SQLITE_STATIC);
+        sqlite3_step(stmt.get());
+        stmt.reset();
+        count++;
+    }
+    sqlite3_exec(db.get(), "COMMIT;", NULL, NULL, NULL);
+    return count;
+}
+
+void HistoryCache::latest(const std::string& conversation, int limit, const CachedMessageVisitor& visit) {
+    Statement stmt(db.get(), "SELECT seq, timestamp, sender, message FROM ("
+         "SELECT * FROM messages WHERE conversation = ? ORDER BY seq DESC LIMIT ?) "
+         "ORDER BY seq;");
+    stmt.bindText(1, conversation);
+    stmt.bindInt(2, limit);
+    while (stmt.step()) {
+        sqlite3_stmt* row = stmt.get();
+        visit(sqlite3_column_int64(row, 0), sqlite3_column_int64(row, 1),
+              std::string_view(reinterpret_cast<const char*>(sqlite3_column_text(row, 2)), sqlite3_column_bytes(row, 2)),
+              std::string_view(reinterpret_cast<const char*>(sqlite3_column_text(row, 3)), sqlite3_column_bytes(row, 3)));
+    }
+}
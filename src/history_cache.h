@@ -0,0 +1,37 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include "database.h"
+
+// Called once per cached message, oldest first. The views are only valid for
+// the duration of the call.
+using CachedMessageVisitor = std::function<void(int64_t sequence, int64_t timestamp, std::string_view sender, std::string_view content)>;
+
+// The client's on-disk copy of the conversations it has opened, one SQLite
+// file per user and server. Conversations are keyed like receipts: the other
+// user, "#<room name>" or "#global". Opening a conversation only asks the
+// server for messages after the newest one cached.
+class HistoryCache {
+public:
+    explicit HistoryCache(const std::string& path);
+
+    // Newest cached sequence number of conversation, 0 when nothing is cached
+    int64_t highWater(const std::string& conversation);
+
+    // highWater of every cached conversation
+    std::vector<std::pair<std::string, int64_t>> highWaters();
+
+    // Store a chat/globalChat/roomChat response, "sequence timestamp sender message"
+    // lines, in one transaction. Returns how many messages it held.
+    size_t store(const std::string& conversation, const std::string& history);
+
+    // The newest limit messages of conversation
+    void latest(const std::string& conversation, int limit, const CachedMessageVisitor& visit);
+
+private:
+    Database db;
+};
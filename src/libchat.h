@@ -0,0 +1,9 @@
+#pragma once
+// Client library for the chat server, built as libchat.a. Coroutines
+// (Task) run on a single threaded EventLoop and talk to servers through
+// ChatSession; one loop carries any number of sessions.
+#include "task.h"
+#include "event_loop.h"
+#include "chat_session.h"
+#include "tls.h"
+#include "utils.h"
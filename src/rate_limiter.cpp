@@ -0,0 +1,72 @@
+#include "rate_limiter.h"
+#include <algorithm>
+#include <cmath>
+
+bool parseRateLimit(const std::string& text, RateLimit& limit) {
+    if (text == "off") {
+        limit = {0, 0};
+        return true;
+    }
+    size_t slash = text.find('/');
+    if (slash == std::string::npos) {
+        return false;
+    }
+    try {
+        limit.rate = std::stod(text.substr(0, slash));
+        limit.burst = std::stod(text.substr(slash + 1));
+    }
+    catch (const std::exception&) {
+        return false;
+    }
+    return limit.rate > 0 && limit.burst >= 1;
+}
+
+RateLimiter::RateLimiter(RateLimit limit) : settings(limit) {
+}
+
+uint32_t RateLimiter::acquire(const std::string& key, Clock::time_point now) {
+    if (settings.rate <= 0) {
+        allowedCount++;
+        return 0;
+    }
+    auto inserted = buckets.try_emplace(key, Bucket{settings.burst, now});
+    Bucket& bucket = inserted.first->second;
+    double elapsed = std::chrono::duration<double>(now - bucket.updated).count();
+    bucket.tokens = std::min(settings.burst, bucket.tokens + elapsed * settings.rate);
+    bucket.updated = now;
+    if (bucket.tokens >= 1) {
+        bucket.tokens -= 1;
+        allowedCount++;
+        return 0;
+    }
+    throttledCount++;
+    return std::max<uint32_t>(1, std::ceil((1 - bucket.tokens) / settings.rate * 1000));
+}
+
+void RateLimiter::prune(Clock::time_point now) {
+    for (auto it = buckets.begin(); it != buckets.end(); ) {
+        double elapsed = std::chrono::duration<double>(now - it->second.updated).count();
+        if (it->second.tokens + elapsed * settings.rate >= settings.burst) {
+            it = buckets.erase(it);
+        }
+        else {
+            it++;
+        }
+    }
+}
+
+RateLimit RateLimiter::limit() const {
+    return settings;
+}
+
+uint64_t RateLimiter::allowed() const {
+    return allowedCount;
+}
+
+uint64_t RateLimiter::throttled() const {
+    return throttledCount;
+}
+
+size_t RateLimiter::keys() const {
+    return buckets.size();
+}
@@ -0,0 +1,47 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+
+// rate tokens per second, at most burst saved up. A rate of 0 means unlimited.
+struct RateLimit {
+    double rate;
+    double burst;
+};
+
+// Parse "<rate>/<burst>", or "off" for no limit
+bool parseRateLimit(const std::string& text, RateLimit& limit);
+
+// One token bucket per key (username, address, ...). Buckets are refilled
+// lazily when touched, so an idle key costs nothing but its map entry, and
+// full buckets are dropped by prune.
+class RateLimiter {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    explicit RateLimiter(RateLimit limit = {0, 0});
+
+    // Take a token for key: 0 when allowed, otherwise how many milliseconds
+    // until the next token
+    uint32_t acquire(const std::string& key, Clock::time_point now);
+
+    // Forget keys whose buckets have refilled completely
+    void prune(Clock::time_point now);
+
+    RateLimit limit() const;
+    uint64_t allowed() const;
+    uint64_t throttled() const;
+    size_t keys() const;
+
+private:
+    struct Bucket {
+        double tokens;
+        Clock::time_point updated;
+    };
+
+    RateLimit settings;
+    std::unordered_map<std::string, Bucket> buckets;
+    uint64_t allowedCount = 0;
+    uint64_t throttledCount = 0;
+};
@@ -0,0 +1,311 @@
+#include <poll.h>
+#include <algorithm>
+#include <csignal>
+#include <deque>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <unordered_map>
+#include <vector>
+#include "utils.h"
+#include "capture.h"
+#include "tls.h"
+
+// Replays a capture written by `server --capture` against a server and reports
+// how fast it went and how long requests took to be answered.
+//
+// Every captured connection gets its own connection. Passwords are not in the
+// capture, so AUTH messages use the password from the credentials file, and
+// later messages carry whatever token the replayed login returned.
+
+// How long to wait for outstanding responses once everything has been sent
+const int DRAIN_TIMEOUT_MS = 5000;
+// Responses beyond this size (long histories are the biggest) end the connection
+const size_t MAX_RESPONSE_SIZE = 64 * 1024 * 1024;
+
+using Clock = std::chrono::steady_clock;
+
+struct Connection {
+    int fd = -1;
+    std::string token;
+    // Send times of the requests still waiting for their response, in order
+    std::deque<std::pair<Message::Type, Clock::time_point>> pending;
+    bool awaitingAuth = false;
+};
+
+class Replay {
+private:
+    std::string serverIP;
+    int port;
+    // Connect over TLS when set
+    SSL_CTX* tlsContext;
+    std::unordered_map<std::string, std::string> passwords;
+    std::unordered_map<uint32_t, Connection> connections;
+    // Response latencies in microseconds, by request type
+    std::map<std::string, std::vector<int64_t>> latencies;
+    uint64_t sent = 0;
+    uint64_t received = 0;
+    uint64_t refused = 0;
+    uint64_t failedConnections = 0;
+
+    static bool expectsResponse(Message::Type type) {
+        return type == Message::Type::AUTH || type == Message::Type::COMMAND || type == Message::Type::CHAT;
+    }
+
+    bool connectTo(Connection& connection) {
+        connection.fd = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in serveraddr;
+        serveraddr.sin_family = AF_INET;
+        serveraddr.sin_port = htons(port);
+        serveraddr.sin_addr.s_addr = inet_addr(serverIP.c_str());
+        if (connect(connection.fd, (struct sockaddr*)&serveraddr, sizeof(serveraddr)) < 0) {
+            close(connection.fd);
+            connection.fd = -1;
+            failedConnections++;
+            return false;
+        }
+        if (tlsContext && !tlsConnect(tlsContext, connection.fd, serverIP)) {
+            close(connection.fd);
+            connection.fd = -1;
+            failedConnections++;
+            return false;
+        }
+        return true;
+    }
+
+    void disconnect(Connection& connection) {
+        if (connection.fd >= 0) {
+            tlsForget(connection.fd);
+            close(connection.fd);
+            connection.fd = -1;
+        }
+        connection.pending.clear();
+        connection.awaitingAuth = false;
+    }
+
+    // Read one message and match it with the oldest request waiting on the connection
+    void receive(Connection& connection) {
+        Message message;
+        if (!receiveMessage(connection.fd, message, MAX_RESPONSE_SIZE)) {
+            disconnect(connection);
+            return;
+        }
+        received++;
+        if (message.type == Message::Type::PING) {
+            // Captured connections can be quiet for longer than the server's heartbeat allows
+            Message pong {
+                .type = Message::Type::PONG,
+                .sender = "",
+                .receiver = "",
+                .content = "",
+                .token = connection.token,
+                .timestamp = std::chrono::system_clock::now()
+            };
+            if (!sendMessage(connection.fd, pong)) {
+                disconnect(connection);
+            }
+            return;
+        }
+        bool response = message.type == Message::Type::AUTH || message.type == Message::Type::COMMAND ||
+            message.type == Message::Type::ERROR ||
+            (message.type == Message::Type::ACK && (message.content == "sent" || message.content == "rejected"));
+        // Refused receipts and "server full" answer none of the requests
+        bool unmatched = message.type == Message::Type::ERROR && (message.sender.empty() || message.sender == messageTypeName(Message::Type::ACK));
+        if (!response || unmatched || connection.pending.empty()) {
+            return;
+        }
+        auto request = connection.pending.front();
+        connection.pending.pop_front();
+        if (message.type == Message::Type::ERROR) {
+            refused++;
+        }
+        else {
+            latencies[messageTypeName(request.first)].push_back(std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - request.second).count());
+        }
+        if (request.first == Message::Type::AUTH) {
+            connection.awaitingAuth = false;
+            connection.token = message.token;
+        }
+    }
+
+    // Read whatever has arrived on any connection, waiting at most timeoutMs
+    void poll(int timeoutMs) {
+        std::vector<pollfd> fds;
+        std::vector<Connection*> owners;
+        for (auto& connection : connections) {
+            if (connection.second.fd >= 0) {
+                fds.push_back({connection.second.fd, POLLIN, 0});
+                owners.push_back(&connection.second);
+            }
+        }
+        // Messages OpenSSL has already decrypted do not make their socket readable
+        bool decrypted = std::any_of(fds.begin(), fds.end(), [](const pollfd& fd) {
+            return tlsPending(fd.fd);
+        });
+        if (::poll(fds.data(), fds.size(), decrypted ? 0 : timeoutMs) <= 0 && !decrypted) {
+            return;
+        }
+        for (size_t i = 0; i < fds.size(); i++) {
+            if (fds[i].revents & (POLLIN | POLLHUP | POLLERR) || tlsPending(fds[i].fd)) {
+                receive(*owners[i]);
+            }
+        }
+    }
+
+    void send(uint32_t id, Message message) {
+        Connection& connection = connections[id];
+        if (message.type == Message::Type::CLOSE) {
+            // Collect the responses still on their way before hanging up
+            while (!connection.pending.empty() && connection.fd >= 0) {
+                receive(connection);
+            }
+            disconnect(connection);
+            return;
+        }
+        if (connection.fd < 0 && !connectTo(connection)) {
+            return;
+        }
+        // Everything after a login needs the token it returns
+        while (connection.awaitingAuth && connection.fd >= 0) {
+            receive(connection);
+        }
+        if (connection.fd < 0) {
+            return;
+        }
+        if (message.type == Message::Type::AUTH) {
+            message.receiver = passwords[message.sender];
+            connection.awaitingAuth = true;
+        }
+        message.token = connection.token;
+        message.timestamp = std::chrono::system_clock::now();
+        if (expectsResponse(message.type)) {
+            connection.pending.push_back({message.type, Clock::now()});
+        }
+        if (!sendMessage(connection.fd, message)) {
+            disconnect(connection);
+            return;
+        }
+        sent++;
+    }
+
+    static int64_t percentile(const std::vector<int64_t>& sorted, double fraction) {
+        return sorted[std::min(sorted.size() - 1, static_cast<size_t>(fraction * sorted.size()))];
+    }
+
+public:
+    Replay(const std::string& serverIP, int port, SSL_CTX* tlsContext, const std::unordered_map<std::string, std::string>& passwords)
+        : serverIP(serverIP), port(port), tlsContext(tlsContext), passwords(passwords) {
+    }
+
+    void run(const std::string& capturePath, bool fast) {
+        CaptureReader reader(capturePath);
+        CaptureRecord record;
+        Clock::time_point start = Clock::now();
+        // The capture's clock starts with the server, the replay with the first message
+        int64_t firstMicros = -1;
+        while (reader.next(record)) {
+            if (firstMicros < 0) {
+                firstMicros = record.micros;
+            }
+            if (!fast) {
+                // Keep up with the capture's pacing, reading responses while waiting
+                Clock::time_point due = start + std::chrono::microseconds(record.micros - firstMicros);
+                while (Clock::now() < due) {
+                    poll(std::max<int>(1, std::chrono::duration_cast<std::chrono::milliseconds>(due - Clock::now()).count()));
+                }
+            }
+            else {
+                poll(0);
+            }
+            send(record.connection, record.message);
+        }
+        double sendSeconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+        Clock::time_point deadline = Clock::now() + std::chrono::milliseconds(DRAIN_TIMEOUT_MS);
+        auto outstanding = [this]() {
+            size_t count = 0;
+            for (const auto& connection : connections) {
+                count += connection.second.pending.size();
+            }
+            return count;
+        };
+        while (outstanding() > 0 && Clock::now() < deadline) {
+            poll(10);
+        }
+        double totalSeconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+        std::cout << "Sent " << sent << " messages on " << connections.size() << " connections in " << sendSeconds << "s ("
+                  << static_cast<int64_t>(sent / std::max(sendSeconds, 1e-6)) << " msg/s)" << std::endl;
+        std::cout << "Received " << received << " messages, all responses in after " << totalSeconds << "s" << std::endl;
+        std::cout << "Refused " << refused << ", unanswered " << outstanding() << ", failed connections " << failedConnections << std::endl;
+        std::cout << "Latency (us)    count      p50      p90      p99      max" << std::endl;
+        for (auto& latency : latencies) {
+            std::vector<int64_t>& samples = latency.second;
+            std::sort(samples.begin(), samples.end());
+            std::cout << std::left << std::setw(12) << latency.first << std::right
+                      << std::setw(9) << samples.size()
+                      << std::setw(9) << percentile(samples, 0.5)
+                      << std::setw(9) << percentile(samples, 0.9)
+                      << std::setw(9) << percentile(samples, 0.99)
+                      << std::setw(9) << samples.back() << std::endl;
+        }
+        for (auto& connection : connections) {
+            disconnect(connection.second);
+        }
+    }
+};
+
+void usage(const char* program) {
+    std::cerr << "Usage: " << program << " <capture file> <serverIP> <port> [--fast] [--credentials <file>] [--tls <CA certificate file>]" << std::endl;
+    std::cerr << "The credentials file has a \"<username> <password>\" line per user that logs in" << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 4) {
+        usage(argv[0]);
+        return 1;
+    }
+    try {
+        int port = std::stoi(argv[3]);
+        if (port < 0 || port > 65535) {
+            std::cerr << "Invalid port number" << std::endl;
+            return 1;
+        }
+        bool fast = false;
+        SSL_CTX* tlsContext = nullptr;
+        std::unordered_map<std::string, std::string> passwords;
+        for (int i = 4; i < argc; i++) {
+            std::string arg = argv[i];
+            if (arg == "--fast") {
+                fast = true;
+            }
+            else if (arg == "--tls" && i + 1 < argc) {
+                tlsContext = tlsClientContext(argv[++i]);
+            }
+            else if (arg == "--credentials" && i + 1 < argc) {
+                std::ifstream credentials(argv[++i]);
+                if (!credentials) {
+                    std::cerr << "Cannot open " << argv[i] << std::endl;
+                    return 1;
+                }
+                std::string username, password;
+                while (credentials >> username >> password) {
+                    passwords[username] = password;
+                }
+            }
+            else {
+                usage(argv[0]);
+                return 1;
+            }
+        }
+        signal(SIGPIPE, SIG_IGN);
+        Replay replay(argv[2], port, tlsContext, passwords);
+        replay.run(argv[1], fast);
+    }
+    catch (const std::exception &e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
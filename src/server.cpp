@@ -1,102 +1,646 @@
 #include <unordered_map>
+#include <map>
 #include <set>
+#include <algorithm>
+#include <charconv>
+#include <csignal>
+#include <fstream>
 #include "utils.h"
+#include "database.h"
+#include "storage.h"
+#include "cluster.h"
+#include "timer_wheel.h"
+#include "handoff.h"
+#include "rate_limiter.h"
+#include "capture.h"
+#include "tls.h"
+#include <fcntl.h>
+#include <climits>
+#include <netinet/tcp.h>
+#include <sys/uio.h>
 
-const std::string DATABASE = "../var/database.sqlite3";
+const int SEARCH_PAGE_SIZE = 20;
+// Connections that have not authenticated by then are closed
+const uint32_t AUTH_DEADLINE_MS = 10000;
+// An authenticated connection this quiet gets a PING...
+const uint32_t HEARTBEAT_MS = 30000;
+// ...and is closed if nothing arrives within this long after it
+const uint32_t PONG_TIMEOUT_MS = 10000;
+// Stored messages and relay frames are written at most this long after they arrive
+const uint32_t FLUSH_DELAY_MS = 10;
+// Dropped relay links are retried this often
+const uint32_t CLUSTER_INTERVAL_MS = 1000;
+// Idle rate limiter buckets are dropped this often
+const uint32_t LIMITER_PRUNE_MS = 10000;
+// select() cannot watch descriptors past FD_SETSIZE, stay below it by default
+const size_t DEFAULT_MAX_CONNECTIONS = 1000;
+// A client announcing a bigger message is dropped rather than buffered
+const size_t MAX_REQUEST_SIZE = 1024 * 1024;
+// A client leaving more than this unread is not keeping up and is dropped
+const size_t MAX_OUTPUT_BACKLOG = 4 * 1024 * 1024;
 
-class Database {
-public:
-    Database() {
-        if (sqlite3_open(DATABASE.c_str(), &db) != SQLITE_OK) {
-            std::cerr << "Error opening database" << std::endl;
-            exit(1);
-        }
+std::string peerAddress(int fd) {
+    sockaddr_in address;
+    socklen_t length = sizeof(address);
+    if (getpeername(fd, (struct sockaddr*)&address, &length) < 0) {
+        return "";
     }
+    return inet_ntoa(address.sin_addr);
+}
 
-    ~Database() {
-        if (db) {
-            sqlite3_close(db);
+// Turn free text into an FTS5 query: every whitespace separated word becomes a
+// quoted string term so user input can never be parsed as FTS5 syntax.
+std::string toMatchQuery(const std::string& query) {
+    std::string result = "";
+    size_t i = 0;
+    while (i < query.size()) {
+        while (i < query.size() && std::isspace(static_cast<unsigned char>(query[i]))) {
+            i++;
+        }
+        if (i == query.size()) {
+            break;
+        }
+        if (!result.empty()) {
+            result += " ";
+        }
+        result += "\"";
+        while (i < query.size() && !std::isspace(static_cast<unsigned char>(query[i]))) {
+            if (query[i] == '"') {
+                result += "\"";
+            }
+            result += query[i++];
         }
+        result += "\"";
     }
+    return result;
+}
 
-    sqlite3* get() {
-        return db;
+// A search page continues after "<score> <id>", the last result of the page before
+bool parseSearchCursor(const std::string& cursor, double& score, std::string& id) {
+    const char* end = cursor.data() + cursor.size();
+    auto parsed = std::from_chars(cursor.data(), end, score);
+    if (parsed.ec != std::errc() || parsed.ptr == end || *parsed.ptr != ' ') {
+        return false;
     }
+    id.assign(parsed.ptr + 1, end);
+    return !id.empty();
+}
+
+class ChatServer {
 private:
-    sqlite3* db;
-};
+    int serverfd;
+    int handoffListenfd = -1;
+    struct sockaddr_in serveraddr;
+    // clientfd to token
+    struct User {
+        std::string username;
+        std::string token;
+        std::vector<std::string> rooms; // "#<room name>" of every room this connection receives
+        std::string address; // Remote IP, for per address limits
+        uint32_t connection = 0; // Id of the connection in the capture
+        bool handshaking = false; // TLS handshake still in progress
+        uint32_t lastActivity = 0; // TimerWheel tick of the last message received
+        bool awaitingPong = false;
+        // A CHAT of this connection waits for the store to commit it; nothing
+        // more is read from it until its ACK is out, so responses stay in order
+        bool awaitingFlush = false;
+        // Received but not yet handled, at most one message and a read's worth
+        std::string input;
+        // Sent but not yet taken by the socket, from written on; the rest goes
+        // out whenever the socket is writable, nothing ever waits for it
+        std::string output;
+        size_t written = 0;
+        // OpenSSL wants a write it could not finish repeated with the same length
+        size_t retryLength = 0;
+        // Output overflowed or could not be written, closed at the next round
+        bool failed = false;
+    };
+    std::unordered_map<int, User> clients;
+    std::unique_ptr<MessageStore> messageStore;
+    std::unique_ptr<Cluster> cluster;
+    std::unique_ptr<CaptureWriter> capture;
+    // Set when clients connect over TLS
+    SSL_CTX* tlsContext = nullptr;
+    uint32_t connections = 0;
+    // "#<room name>" to the sorted clientfds of its connected members. Room
+    // messages only ever touch these, never the whole clients map.
+    std::unordered_map<std::string, std::vector<int>> roomConnections;
+    // Messages appended to the store that nobody has heard of yet
+    struct Stored {
+        int clientfd;
+        uint32_t connection;
+        Message message;
+    };
+    std::vector<Stored> stored;
 
-class Statement {
-public:
-    Statement(sqlite3* db, const std::string& sql) {
-        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, NULL) != SQLITE_OK) {
-            std::cerr << "Error creating statement" << std::endl;
-            exit(1);
+    // Admission control. Every message is charged to its connection's address,
+    // then to its user and to its opcode, each a token bucket:
+    //   ip       all messages from one IP address
+    //   auth     AUTH messages from one IP address
+    //   user     all messages of one user, over all of its connections
+    //   chat     CHAT messages of one user
+    //   command  COMMAND messages of one user
+    //   accept   new connections, server wide; the listening socket is not
+    //            read while it is empty, so excess connections wait in the backlog
+    std::map<std::string, RateLimiter> limiters = {
+        {"ip", RateLimiter({50, 100})},
+        {"auth", RateLimiter({1, 5})},
+        {"user", RateLimiter({20, 40})},
+        {"chat", RateLimiter({10, 20})},
+        {"command", RateLimiter({5, 10})},
+        {"accept", RateLimiter({100, 200})}
+    };
+    size_t maxConnections = DEFAULT_MAX_CONNECTIONS;
+    uint64_t connectionsRejected = 0;
+    uint64_t acceptsDelayed = 0;
+
+    // Timer ids: one per clientfd after the server wide timers
+    static const uint32_t FLUSH_TIMER = 0;
+    static const uint32_t CLUSTER_TIMER = 1;
+    static const uint32_t ACCEPT_TIMER = 2;
+    static const uint32_t PRUNE_TIMER = 3;
+    static const uint32_t FIRST_CONNECTION_TIMER = 4;
+    TimerWheel timers;
+
+    void flush() {
+        messageStore->flush();
+        releaseStored();
+        if (cluster) {
+            cluster->flush();
+        }
+        if (capture) {
+            capture->flush();
         }
     }
 
-    ~Statement() {
-        if (stmt) {
-            sqlite3_finalize(stmt);
+    // False when the client cannot take another message
+    bool acceptsOutput(int clientfd, User& user) {
+        if (user.failed) {
+            return false;
+        }
+        // Checked before adding, so one large response is never too much on its own
+        if (user.output.size() - user.written > MAX_OUTPUT_BACKLOG) {
+            std::cout << "Output backlog full for " << clientfd << std::endl;
+            user.failed = true;
+            return false;
         }
+        return true;
     }
 
-    void bindText(int index, const std::string& value) {
-        if (sqlite3_bind_text(stmt, index, value.c_str(), -1, SQLITE_TRANSIENT) != SQLITE_OK) {
-            std::cerr << "Error binding text" << std::endl;
-            exit(1);
+    // Queue a message for a client and write as much of its output as the socket takes
+    void sendTo(int clientfd, const Message& message) {
+        User& user = clients[clientfd];
+        if (!acceptsOutput(clientfd, user)) {
+            return;
         }
+        user.output += encodeMessage(message);
+        writeOutput(clientfd, user);
     }
 
-    void bindInt(int index, int value) {
-        if (sqlite3_bind_int(stmt, index, value) != SQLITE_OK) {
-            std::cerr << "Error binding integer" << std::endl;
-            exit(1);
+    // The content of a response as a list of pieces. Pieces from a store with
+    // stable history are referenced where they lie, the rest is copied into own.
+    struct Gathered {
+        struct Piece {
+            const char* data; // NULL for bytes at offset in own
+            size_t offset;
+            size_t size;
+        };
+        std::string own;
+        std::vector<Piece> pieces;
+        size_t size = 0;
+
+        void add(std::string_view bytes, bool stable) {
+            if (bytes.empty()) {
+                return;
+            }
+            size += bytes.size();
+            if (stable) {
+                pieces.push_back({bytes.data(), 0, bytes.size()});
+                return;
+            }
+            if (!pieces.empty() && pieces.back().data == NULL) {
+                // Copied pieces in a row are one piece
+                pieces.back().size += bytes.size();
+            }
+            else {
+                pieces.push_back({NULL, own.size(), bytes.size()});
+            }
+            own += bytes;
+        }
+    };
+
+    // A "<sequence> <timestamp> <sender> [<conversation> ]<content>" history line
+    void addHistoryLine(Gathered& response, int64_t sequence, int64_t timestamp, std::string_view sender, const std::string& conversation, std::string_view content) {
+        bool stable = messageStore->stableHistory();
+        response.add(std::to_string(sequence) + " " + std::to_string(timestamp) + " ", false);
+        response.add(sender, stable);
+        response.add(conversation.empty() ? " " : " " + conversation + " ", false);
+        response.add(content, stable);
+        response.add("\n", false);
+    }
+
+    // Send message with the gathered content. With nothing queued ahead of it
+    // and a socket that is written as it is, it goes out with writev() straight
+    // from the pieces; only what the socket does not take is copied to output.
+    void sendGathered(int clientfd, const Message& message, const Gathered& content) {
+        User& user = clients[clientfd];
+        if (!acceptsOutput(clientfd, user)) {
+            return;
+        }
+        std::string head;
+        std::string tail;
+        encodeMessageAround(message, content.size, head, tail);
+        std::vector<iovec> iov;
+        iov.push_back({head.data(), head.size()});
+        for (const auto& piece : content.pieces) {
+            const char* data = piece.data != NULL ? piece.data : content.own.data() + piece.offset;
+            iov.push_back({const_cast<char*>(data), piece.size});
+        }
+        iov.push_back({tail.data(), tail.size()});
+        size_t next = 0;
+        if (user.written == user.output.size() && tlsSendsInKernel(clientfd)) {
+            while (next < iov.size()) {
+                ssize_t bytes = writev(clientfd, &iov[next], std::min<size_t>(iov.size() - next, IOV_MAX));
+                if (bytes < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (bytes < 0 && errno == EAGAIN) {
+                    break;
+                }
+                if (bytes <= 0) {
+                    user.failed = true;
+                    return;
+                }
+                while (next < iov.size() && static_cast<size_t>(bytes) >= iov[next].iov_len) {
+                    bytes -= iov[next].iov_len;
+                    next++;
+                }
+                if (bytes > 0) {
+                    iov[next].iov_base = static_cast<char*>(iov[next].iov_base) + bytes;
+                    iov[next].iov_len -= bytes;
+                }
+            }
         }
+        for (; next < iov.size(); next++) {
+            user.output.append(static_cast<const char*>(iov[next].iov_base), iov[next].iov_len);
+        }
+        writeOutput(clientfd, user);
     }
 
-    void clearBindings() {
-        if (sqlite3_clear_bindings(stmt) != SQLITE_OK) {
-            std::cerr << "Error clearing bindings" << std::endl;
-            exit(1);
+    void writeOutput(int clientfd, User& user) {
+        while (user.written < user.output.size()) {
+            size_t length = user.retryLength > 0 ? user.retryLength : user.output.size() - user.written;
+            ssize_t bytes = tlsWrite(clientfd, user.output.data() + user.written, length);
+            if (bytes > 0) {
+                user.written += bytes;
+                user.retryLength = 0;
+                continue;
+            }
+            if (bytes < 0 && errno == EINTR) {
+                continue;
+            }
+            if (bytes < 0 && errno == EAGAIN) {
+                user.retryLength = length;
+                user.output.erase(0, user.written);
+                user.written = 0;
+                return;
+            }
+            user.failed = true;
+            return;
         }
+        user.output.clear();
+        user.written = 0;
     }
 
-    void reset() {
-        if (sqlite3_reset(stmt) != SQLITE_OK) {
-            std::cerr << "Error resetting statement" << std::endl;
-            exit(1);
+    // Everything stored so far is durable: tell the senders where their
+    // messages landed, then pass the messages on
+    void releaseStored() {
+        std::vector<Stored> released;
+        released.swap(stored);
+        for (const Stored& entry : released) {
+            auto client = clients.find(entry.clientfd);
+            if (client != clients.end() && client->second.connection == entry.connection) {
+                Message sentMessage {
+                    .type = Message::Type::ACK,
+                    .sender = "",
+                    .receiver = entry.message.receiver,
+                    .content = "sent",
+                    .token = entry.message.token,
+                    .timestamp = std::chrono::system_clock::now(),
+                    .sequence = entry.message.sequence
+                };
+                sendTo(entry.clientfd, sentMessage);
+                client->second.awaitingFlush = false;
+            }
+            deliver(entry.message);
+            if (cluster) {
+                cluster->relay(entry.message);
+            }
         }
     }
 
-    bool step() {
-        return sqlite3_step(stmt) == SQLITE_ROW;
+    // A connection's single timer is its auth deadline until it authenticates,
+    // then the heartbeat. Activity only stamps lastActivity, the timer catches
+    // up lazily when it fires.
+    void connectionTimer(int clientfd) {
+        auto it = clients.find(clientfd);
+        if (it == clients.end()) {
+            return;
+        }
+        User& user = it->second;
+        if (user.token.empty()) {
+            std::cout << "Authentication deadline passed for " << clientfd << std::endl;
+            dropClient(it);
+            return;
+        }
+        if (user.awaitingPong) {
+            std::cout << "Heartbeat timed out for " << user.username << std::endl;
+            dropClient(it);
+            return;
+        }
+        uint32_t idleMs = (timers.now() - user.lastActivity) * TimerWheel::TICK_MS;
+        if (idleMs < HEARTBEAT_MS) {
+            timers.schedule(FIRST_CONNECTION_TIMER + clientfd, HEARTBEAT_MS - idleMs);
+            return;
+        }
+        Message ping {
+            .type = Message::Type::PING,
+            .sender = "",
+            .receiver = "",
+            .content = "",
+            .token = user.token,
+            .timestamp = std::chrono::system_clock::now()
+        };
+        sendTo(clientfd, ping);
+        user.awaitingPong = true;
+        timers.schedule(FIRST_CONNECTION_TIMER + clientfd, PONG_TIMEOUT_MS);
     }
 
-    const char* getColumnText(int columnIndex) {
-        return reinterpret_cast<const char*>(sqlite3_column_text(stmt, columnIndex));
+    void expire(uint32_t id) {
+        if (id == FLUSH_TIMER) {
+            flush();
+        }
+        else if (id == CLUSTER_TIMER) {
+            cluster->flush();
+            timers.schedule(CLUSTER_TIMER, CLUSTER_INTERVAL_MS);
+        }
+        else if (id == ACCEPT_TIMER) {
+            // The listening socket is watched again from the next round
+        }
+        else if (id == PRUNE_TIMER) {
+            auto now = RateLimiter::Clock::now();
+            for (auto& limiter : limiters) {
+                limiter.second.prune(now);
+            }
+            timers.schedule(PRUNE_TIMER, LIMITER_PRUNE_MS);
+        }
+        else {
+            connectionTimer(id - FIRST_CONNECTION_TIMER);
+        }
     }
 
-    sqlite3_stmt* get() {
-        return stmt;
+    // 0 when the message may be handled, otherwise milliseconds until the
+    // bucket that refused it has a token again. The narrowest bucket is asked
+    // first, so a client refused for its own excess never spends the tokens
+    // its address shares with others.
+    uint32_t admit(const User& user, const Message& message) {
+        auto now = RateLimiter::Clock::now();
+        uint32_t retryMs = 0;
+        if (message.type == Message::Type::AUTH) {
+            retryMs = limiters.at("auth").acquire(user.address, now);
+        }
+        else if (!user.token.empty()) {
+            if (message.type == Message::Type::CHAT) {
+                retryMs = limiters.at("chat").acquire(user.username, now);
+            }
+            else if (message.type == Message::Type::COMMAND) {
+                retryMs = limiters.at("command").acquire(user.username, now);
+            }
+            if (retryMs == 0) {
+                retryMs = limiters.at("user").acquire(user.username, now);
+            }
+        }
+        if (retryMs == 0) {
+            retryMs = limiters.at("ip").acquire(user.address, now);
+        }
+        return retryMs;
     }
-private:
-    sqlite3_stmt* stmt;
-};
 
-class ChatServer {
-private:
-    int serverfd;
-    struct sockaddr_in serveraddr;
-    // clientfd to token
-    struct User {
-        std::string username;
-        std::string token;
+    enum class Input {
+        MESSAGE,
+        PARTIAL, // wait for the socket to become readable again
+        CLOSED,
+        MALFORMED
     };
-    std::unordered_map<int, User> clients;
+
+    // Take the next message off the connection's input, reading from the
+    // socket only when no whole message is buffered: one read per round keeps
+    // a fast sender from starving the others
+    Input readMessage(int clientfd, User& user, Message& message) {
+        size_t size = decodeMessage(user.input, message, MAX_REQUEST_SIZE);
+        if (size == 0) {
+            char buffer[16384];
+            ssize_t bytes = tlsRead(clientfd, buffer, sizeof(buffer));
+            if (bytes < 0 && (errno == EAGAIN || errno == EINTR)) {
+                return Input::PARTIAL;
+            }
+            if (bytes <= 0) {
+                return Input::CLOSED;
+            }
+            user.input.append(buffer, bytes);
+            size = decodeMessage(user.input, message, MAX_REQUEST_SIZE);
+        }
+        if (size == MALFORMED_MESSAGE) {
+            return Input::MALFORMED;
+        }
+        if (size == 0) {
+            return Input::PARTIAL;
+        }
+        user.input.erase(0, size);
+        return Input::MESSAGE;
+    }
+
+    // Tell a client why its request went unanswered
+    void refuse(int clientfd, const Message& message, const std::string& reason) {
+        // The type tells the client which of its requests this answers: a
+        // refused receipt answers no request
+        Message errorMessage {
+            .type = Message::Type::ERROR,
+            .sender = messageTypeName(message.type),
+            .receiver = message.receiver,
+            .content = reason,
+            .token = message.token,
+            .timestamp = std::chrono::system_clock::now()
+        };
+        sendTo(clientfd, errorMessage);
+    }
+
+    void subscribe(int clientfd, const std::string& room) {
+        std::vector<int>& connections = roomConnections[room];
+        auto position = std::lower_bound(connections.begin(), connections.end(), clientfd);
+        if (position != connections.end() && *position == clientfd) {
+            return;
+        }
+        connections.insert(position, clientfd);
+        clients[clientfd].rooms.push_back(room);
+    }
+
+    void unsubscribe(int clientfd, const std::string& room) {
+        auto connections = roomConnections.find(room);
+        if (connections != roomConnections.end()) {
+            auto position = std::lower_bound(connections->second.begin(), connections->second.end(), clientfd);
+            if (position != connections->second.end() && *position == clientfd) {
+                connections->second.erase(position);
+            }
+            if (connections->second.empty()) {
+                roomConnections.erase(connections);
+            }
+        }
+        std::vector<std::string>& rooms = clients[clientfd].rooms;
+        rooms.erase(std::remove(rooms.begin(), rooms.end(), room), rooms.end());
+    }
+
+    void unsubscribeAll(int clientfd) {
+        std::vector<std::string> rooms = clients[clientfd].rooms;
+        for (const auto& room : rooms) {
+            unsubscribe(clientfd, room);
+        }
+    }
+
+    // Every session of the user follows its membership of a room
+    void followMembership(const std::string& username, const std::string& room, bool joined) {
+        for (auto& client : clients) {
+            if (client.second.username == username && !client.second.token.empty()) {
+                if (joined) {
+                    subscribe(client.first, room);
+                }
+                else {
+                    unsubscribe(client.first, room);
+                }
+            }
+        }
+    }
+
+    bool subscribed(int clientfd, const std::string& room) {
+        const std::vector<std::string>& rooms = clients[clientfd].rooms;
+        return std::find(rooms.begin(), rooms.end(), room) != rooms.end();
+    }
+
+    // Send a CHAT or ACK message to the online clients it is addressed to
+    void deliver(const Message& message) {
+        if (isRoom(message.receiver)) {
+            auto connections = roomConnections.find(message.receiver);
+            if (connections == roomConnections.end()) {
+                return;
+            }
+            for (int clientfd : connections->second) {
+                const User& user = clients[clientfd];
+                if (user.username == message.sender) {
+                    continue;
+                }
+                Message responseMessage {
+                    .type = message.type,
+                    .sender = message.sender,
+                    .receiver = message.receiver,
+                    .content = message.content,
+                    .token = user.token,
+                    .timestamp = message.timestamp,
+                    .sequence = message.sequence
+                };
+                sendTo(clientfd, responseMessage);
+            }
+            return;
+        }
+        for (auto& client : clients) {
+            if (client.second.username != message.sender) {
+                bool shouldSend =  (!client.second.token.empty()) && (message.receiver.empty() || client.second.username == message.receiver);
+                if (shouldSend) {
+                    std::cout << "Sending message to " << client.second.token << std::endl;
+                    Message responseMessage {
+                        .type = message.type,
+                        .sender = message.sender,
+                        .receiver = message.receiver,
+                        .content = message.content,
+                        .token = client.second.token,
+                        .timestamp = message.timestamp,
+                        .sequence = message.sequence
+                    };
+                    sendTo(client.first, responseMessage);
+                }
+            }
+        }
+    }
+
+    std::unordered_map<int, User>::iterator dropClient(std::unordered_map<int, User>::iterator it) {
+        if (cluster && !it->second.token.empty()) {
+            cluster->userOffline(it->second.username);
+        }
+        if (capture) {
+            Message closeMessage {
+                .type = Message::Type::CLOSE,
+                .sender = it->second.username,
+                .receiver = "",
+                .content = "",
+                .token = "",
+                .timestamp = std::chrono::system_clock::now()
+            };
+            capture->record(it->second.connection, closeMessage);
+        }
+        unsubscribeAll(it->first);
+        timers.cancel(FIRST_CONNECTION_TIMER + it->first);
+        tlsForget(it->first);
+        close(it->first);
+        return clients.erase(it);
+    }
+
+    // Give the listening socket and every connection to the new server, then
+    // get out of its way: ports and storage are released before the handoff
+    // socket closes, which is what the new server waits for.
+    void handOff() {
+        int connfd = acceptHandoff(handoffListenfd);
+        if (connfd < 0) {
+            return;
+        }
+        flush();
+        HandoffState state;
+        state.listenfd = serverfd;
+        state.connections = connections;
+        for (const auto& client : clients) {
+            const User& user = client.second;
+            // TLS state that lives in this process cannot go along; those clients reconnect
+            if (user.handshaking || !tlsInKernel(client.first)) {
+                std::cout << "Cannot hand off " << tlsMode(client.first) << " connection " << client.first << std::endl;
+                if (capture) {
+                    Message closeMessage {
+                        .type = Message::Type::CLOSE,
+                        .sender = user.username,
+                        .receiver = "",
+                        .content = "",
+                        .token = "",
+                        .timestamp = std::chrono::system_clock::now()
+                    };
+                    capture->record(user.connection, closeMessage);
+                }
+                continue;
+            }
+            uint32_t idleMs = (timers.now() - user.lastActivity) * TimerWheel::TICK_MS;
+            state.sessions.push_back({client.first, user.username, user.token, user.rooms, idleMs, user.awaitingPong, user.input, user.output.substr(user.written), user.connection});
+        }
+        if (!sendHandoff(connfd, state)) {
+            std::cerr << "Handoff failed, carrying on" << std::endl;
+            close(connfd);
+            return;
+        }
+        std::cout << "Handed off " << state.sessions.size() << " connections, exiting" << std::endl;
+        cluster.reset();
+        messageStore.reset();
+        capture.reset();
+        close(connfd);
+        exit(0);
+    }
 
 public:
-    ChatServer(int port) {
+    ChatServer(int port, std::unique_ptr<MessageStore> store) : messageStore(std::move(store)) {
         serverfd = socket(AF_INET, SOCK_STREAM, 0);
         int optval = 1;
         setsockopt(serverfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
@@ -106,34 +650,184 @@ public:
         serveraddr.sin_port = htons(port);
         bind(serverfd, (struct sockaddr*)&serveraddr, sizeof(serveraddr));
         std::cout << "Server started on port " << port << std::endl;
-        listen(serverfd, 5);
+        // A bot host connects all its sessions at once; connections beyond
+        // the backlog are left half open and stall until TCP gives up
+        listen(serverfd, SOMAXCONN);
+    }
+
+    // Carry on with the connections of the server we took over from
+    ChatServer(const HandoffState& state, std::unique_ptr<MessageStore> store) : messageStore(std::move(store)) {
+        serverfd = state.listenfd;
+        // Connections keep their ids, so a capture continued here stays one capture
+        connections = state.connections;
+        for (const auto& session : state.sessions) {
+            clients[session.fd] = {session.username, session.token};
+            clients[session.fd].address = peerAddress(session.fd);
+            clients[session.fd].connection = session.connection;
+            for (const auto& room : session.rooms) {
+                subscribe(session.fd, room);
+            }
+            User& user = clients[session.fd];
+            user.lastActivity = timers.now() - session.idleMs / TimerWheel::TICK_MS;
+            user.awaitingPong = session.awaitingPong;
+            user.input = session.input;
+            user.output = session.output;
+            fcntl(session.fd, F_SETFL, fcntl(session.fd, F_GETFL, 0) | O_NONBLOCK);
+            if (user.token.empty()) {
+                timers.schedule(FIRST_CONNECTION_TIMER + session.fd, AUTH_DEADLINE_MS);
+            }
+            else if (user.awaitingPong) {
+                timers.schedule(FIRST_CONNECTION_TIMER + session.fd, PONG_TIMEOUT_MS);
+            }
+            else {
+                timers.schedule(FIRST_CONNECTION_TIMER + session.fd, session.idleMs < HEARTBEAT_MS ? HEARTBEAT_MS - session.idleMs : 0);
+            }
+        }
+        std::cout << "Server resumed with " << clients.size() << " connections" << std::endl;
     }
 
     ~ChatServer() {
         close(serverfd);
     }
 
+    // Returns false for an unknown limit name
+    bool setLimit(const std::string& name, RateLimit limit) {
+        auto limiter = limiters.find(name);
+        if (limiter == limiters.end()) {
+            return false;
+        }
+        limiter->second = RateLimiter(limit);
+        return true;
+    }
+
+    // Clients connect over TLS from now on
+    void useTls(const std::string& certFile, const std::string& keyFile) {
+        tlsContext = tlsServerContext(certFile, keyFile);
+    }
+
+    // Record every message received from now on. A server that took over
+    // continues the capture of the one before it.
+    void captureTo(const std::string& path, bool resume) {
+        capture = std::make_unique<CaptureWriter>(path, resume);
+    }
+
+    void setMaxConnections(size_t connections) {
+        maxConnections = std::min<size_t>(connections, FD_SETSIZE - FIRST_CONNECTION_TIMER);
+    }
+
+    void joinCluster(const std::string& nodeAddress, const std::vector<std::string>& peers, const std::string& secret) {
+        cluster = std::make_unique<Cluster>(nodeAddress, peers, secret, [this](const Message& message) {
+            deliver(message);
+        }, [this](const std::string& username, const std::string& room, bool joined) {
+            followMembership(username, room, joined);
+        });
+        // Sessions taken over from a previous server are online here now
+        for (const auto& client : clients) {
+            if (!client.second.token.empty()) {
+                cluster->userOnline(client.second.username);
+            }
+        }
+        timers.schedule(CLUSTER_TIMER, 0);
+    }
+
+    void listenForHandoff(const std::string& path) {
+        handoffListenfd = ::listenForHandoff(path);
+    }
+
     void run() {
+        timers.schedule(PRUNE_TIMER, LIMITER_PRUNE_MS);
         while (true) {
+            // Timers go first: a connection they drop must not be in the sets
+            // below, or its fd number, reused by accept, would look readable
+            timers.advance([this](uint32_t id) {
+                expire(id);
+            });
+
+            // Connections that stopped reading, or whose socket failed, since the last round
+            for (auto it = clients.begin(); it != clients.end(); ) {
+                if (it->second.failed) {
+                    std::cerr << "Closing connection with " << it->first << std::endl;
+                    it = dropClient(it);
+                }
+                else {
+                    it++;
+                }
+            }
+
+            // What the last round and the timers left behind is committed and
+            // relayed together within FLUSH_DELAY_MS. With nothing waiting the
+            // timer stays off, so an idle server sleeps until the next connection timer.
+            bool pending = !stored.empty() || (cluster && cluster->pending()) || (capture && capture->pending());
+            if (pending && !timers.scheduled(FLUSH_TIMER)) {
+                timers.schedule(FLUSH_TIMER, FLUSH_DELAY_MS);
+            }
+
             // Use select to handle multiple clients
             fd_set readfds;
+            fd_set writefds;
             FD_ZERO(&readfds);
+            FD_ZERO(&writefds);
 
-            // Add server socket to set
-            FD_SET(serverfd, &readfds);
+            // Add server socket to set, unless accepts are being held back
+            if (!timers.scheduled(ACCEPT_TIMER)) {
+                FD_SET(serverfd, &readfds);
+            }
+            if (handoffListenfd >= 0) {
+                FD_SET(handoffListenfd, &readfds);
+            }
 
             // Add client sockets to set
             for (auto& client : clients) {
-                FD_SET(client.first, &readfds);
+                if (!client.second.awaitingFlush) {
+                    FD_SET(client.first, &readfds);
+                }
+                if (client.second.written < client.second.output.size()) {
+                    FD_SET(client.first, &writefds);
+                }
             }
-            
-            int activity = select(FD_SETSIZE, &readfds, NULL, NULL, NULL);
+
+            if (cluster) {
+                cluster->addFds(readfds, writefds);
+            }
+
+            // Messages already read from the socket, whole or decrypted by
+            // OpenSSL, do not make their socket readable
+            std::vector<int> buffered;
+            for (auto& client : clients) {
+                if (!client.second.awaitingFlush && (messageLength(client.second.input, MAX_REQUEST_SIZE) != 0 || (tlsContext && tlsPending(client.first)))) {
+                    buffered.push_back(client.first);
+                }
+            }
+
+            // Sleep until the next timer is due
+            int waitMs = buffered.empty() ? timers.millisecondsUntilNext() : 0;
+            struct timeval timeout = {waitMs / 1000, (waitMs % 1000) * 1000};
+            int activity = select(FD_SETSIZE, &readfds, &writefds, NULL, waitMs < 0 ? NULL : &timeout);
             if (activity < 0 && errno != EINTR) {
                 std::cerr << "Error in select" << std::endl;
                 continue;
             }
+            for (int clientfd : buffered) {
+                FD_SET(clientfd, &readfds);
+            }
+            if (activity <= 0 && buffered.empty()) {
+                continue;
+            }
 
-            if (FD_ISSET(serverfd, &readfds)) {
+            if (cluster) {
+                cluster->handle(readfds, writefds);
+            }
+
+            if (handoffListenfd >= 0 && FD_ISSET(handoffListenfd, &readfds)) {
+                handOff();
+            }
+
+            uint32_t acceptRetryMs = 0;
+            if (FD_ISSET(serverfd, &readfds) && (acceptRetryMs = limiters.at("accept").acquire("", RateLimiter::Clock::now())) > 0) {
+                acceptsDelayed++;
+                timers.schedule(ACCEPT_TIMER, acceptRetryMs);
+            }
+            else if (FD_ISSET(serverfd, &readfds)) {
                 // Handle new client connection
                 sockaddr_in clientaddr;
                 socklen_t clientaddr_len = sizeof(clientaddr);
@@ -143,22 +837,89 @@ public:
                     continue;
                 }
                 std::cout << "New client connected: " << inet_ntoa(clientaddr.sin_addr) << ":" << ntohs(clientaddr.sin_port) << std::endl;
+                if (clients.size() >= maxConnections || clientfd >= FD_SETSIZE) {
+                    std::cout << "Too many connections, closing " << clientfd << std::endl;
+                    if (!tlsContext) {
+                        // Not about any request, so no request type in sender
+                        Message fullMessage {
+                            .type = Message::Type::ERROR,
+                            .sender = "",
+                            .receiver = "",
+                            .content = "server full",
+                            .token = "",
+                            .timestamp = std::chrono::system_clock::now()
+                        };
+                        // One try: a new connection has room in its socket buffer, and
+                        // a client that does not read is not waited for
+                        std::string full = encodeMessage(fullMessage);
+                        send(clientfd, full.data(), full.size(), MSG_DONTWAIT);
+                    }
+                    close(clientfd);
+                    connectionsRejected++;
+                    continue;
+                }
+                // Messages go out in a single write each, Nagle could only delay them
+                int optval = 1;
+                setsockopt(clientfd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
                 clients[clientfd] = {};
+                clients[clientfd].address = inet_ntoa(clientaddr.sin_addr);
+                clients[clientfd].connection = ++connections;
+                // Reads take what has arrived, so a client sending half a message cannot stall the server
+                fcntl(clientfd, F_SETFL, fcntl(clientfd, F_GETFL, 0) | O_NONBLOCK);
+                if (tlsContext) {
+                    clients[clientfd].handshaking = true;
+                }
+                timers.schedule(FIRST_CONNECTION_TIMER + clientfd, AUTH_DEADLINE_MS);
             }
 
             // Handle client activity
             for (auto it = clients.begin(); it != clients.end(); ) {
                 int clientfd = it->first;
                 // std::cout << clientfd << std::endl;
-                if (FD_ISSET(clientfd, &readfds)) {
+                if (FD_ISSET(clientfd, &writefds) && !it->second.handshaking) {
+                    writeOutput(clientfd, it->second);
+                }
+                if (FD_ISSET(clientfd, &readfds) && it->second.handshaking) {
+                    TlsStatus status = tlsAccept(tlsContext, clientfd);
+                    if (status == TlsStatus::FAILED) {
+                        std::cerr << "TLS handshake failed with " << clientfd << std::endl;
+                        it = dropClient(it);
+                        continue;
+                    }
+                    if (status == TlsStatus::DONE) {
+                        it->second.handshaking = false;
+                        std::cout << "TLS established with " << clientfd << " (" << tlsMode(clientfd) << ")" << std::endl;
+                    }
+                }
+                else if (FD_ISSET(clientfd, &readfds)) {
                     // Do something
                     Message message;
-                    if (!receiveMessage(clientfd, message)) {
+                    Input input = readMessage(clientfd, it->second, message);
+                    if (input == Input::PARTIAL) {
+                        it++;
+                        continue;
+                    }
+                    if (input != Input::MESSAGE) {
+                        if (input == Input::MALFORMED) {
+                            std::cerr << "Malformed message from " << clientfd << std::endl;
+                        }
                         std::cerr << "Closing connection with " << clientfd << std::endl;
-                        close(clientfd);
-                        it = clients.erase(it++);
+                        it = dropClient(it);
                         continue;
                     }
+                    it->second.lastActivity = timers.now();
+                    it->second.awaitingPong = false;
+                    if (capture) {
+                        capture->record(it->second.connection, message);
+                    }
+                    if (message.type != Message::Type::PING && message.type != Message::Type::PONG) {
+                        uint32_t retryMs = admit(it->second, message);
+                        if (retryMs > 0) {
+                            refuse(clientfd, message, "throttled " + std::to_string(retryMs));
+                            it++;
+                            continue;
+                        }
+                    }
                     if (message.type == Message::Type::AUTH) {
                         std::cout << "Received auth message. Username: " << message.sender << " password: " << message.receiver << std::endl;
                         // Check credentials
@@ -171,14 +932,29 @@ public:
                             std::cout << "Authentication successful" << std::endl;
                             std::string token = generateRandomToken();
                             message.token = token;
-                            sendMessage(clientfd, message);
-                            clients[clientfd] = {message.sender, token};
+                            sendTo(clientfd, message);
+                            if (cluster) {
+                                if (!it->second.token.empty()) {
+                                    cluster->userOffline(it->second.username);
+                                }
+                                cluster->userOnline(message.sender);
+                            }
+                            unsubscribeAll(clientfd);
+                            it->second.username = message.sender;
+                            it->second.token = token;
+                            timers.schedule(FIRST_CONNECTION_TIMER + clientfd, HEARTBEAT_MS);
+                            Statement roomsStmt(db.get(), "SELECT '#' || r.name FROM room_members m "
+                                 "JOIN rooms r ON r.id = m.room_id "
+                                 "WHERE m.user_id = ?;");
+                            roomsStmt.bindInt(1, userID(db, message.sender));
+                            while (roomsStmt.step()) {
+                                subscribe(clientfd, roomsStmt.getColumnText(0));
+                            }
                         }
                         else {
                             std::cout << "Authentication failed" << std::endl;
-                            sendMessage(clientfd, message);
-                            close(clientfd);
-                            it = clients.erase(it++);
+                            sendTo(clientfd, message);
+                            it = dropClient(it);
                             continue;
                         }
                     }
@@ -194,74 +970,79 @@ public:
                             .token = "",
                             .timestamp = std::chrono::system_clock::now()
                         };
-                        sendMessage(clientfd, responseMessage);
-                        close(clientfd);
-                        it = clients.erase(it++);
+                        sendTo(clientfd, responseMessage);
+                        it = dropClient(it);
                         continue;
                     }
 
                     if (message.type == Message::Type::CHAT) {
+                        // Messages always come from the authenticated user
+                        message.sender = clients[clientfd].username;
+                    }
+                    if (message.type == Message::Type::CHAT && isRoom(message.receiver) && !subscribed(clientfd, message.receiver)) {
+                        std::cout << message.sender << " is not a member of " << message.receiver << std::endl;
+                        Message rejectedMessage {
+                            .type = Message::Type::ACK,
+                            .sender = "",
+                            .receiver = message.receiver,
+                            .content = "rejected",
+                            .token = message.token,
+                            .timestamp = std::chrono::system_clock::now()
+                        };
+                        sendTo(clientfd, rejectedMessage);
+                    }
+                    else if (message.type == Message::Type::CHAT) {
                         if (message.receiver == "") {
                             std::cout << "Global chat: " << message.sender << ": " << message.content << std::endl;
-                            // Insert into global_messages table
-                            Database db;
-                            Statement stmt(db.get(), "SELECT id from users where username = ?");
-                            stmt.bindText(1, message.sender);
-                            int userID = -1;
-                            if (stmt.step()) {
-                                userID = sqlite3_column_int(stmt.get(), 0);
-                            }
-
-                            Statement stmt2(db.get(), "INSERT INTO global_messages (sender_id, message) VALUES (?, ?)");
-                            stmt2.bindInt(1, userID);
-                            stmt2.bindText(2, message.content);
-                            int result = sqlite3_step(stmt2.get());
-                            if (result != SQLITE_DONE) {
-                                std::cerr << "Error inserting into global_messages table" << std::endl;
-                            }
                         }
                         else {
                             std::cout << message.sender << " -> " << message.receiver << ": " << message.content << std::endl;
-                            // Insert chat into db
-                            Database db;
-                            Statement stmt(db.get(), "SELECT id FROM users WHERE username = ?");
-                            stmt.bindText(1, message.sender);
-                            int user1ID = -1;
-                            int user2ID = -1;
-                            if (stmt.step()) {
-                                user1ID = sqlite3_column_int(stmt.get(), 0);
-                            }
-                            stmt.reset();
-                            stmt.clearBindings();
-                            stmt.bindText(1, message.receiver);
-                            if (stmt.step()) {
-                                user2ID = sqlite3_column_int(stmt.get(), 0);
-                            }
-                            Statement stmt2(db.get(), "INSERT INTO messages (sender_id, receiver_id, message) VALUES (?, ?, ?)");
-                            stmt2.bindInt(1, user1ID);
-                            stmt2.bindInt(2, user2ID);
-                            stmt2.bindText(3, message.content);
-                            int result = sqlite3_step(stmt2.get());
-                            if (result != SQLITE_DONE) {
-                                std::cerr << "Error inserting message into db" << std::endl;
-                            }
                         }
-                        // Send message to receiver clients if they are online
-                        for (auto& client : clients) {
-                            if (client.second.username != message.sender) {
-                                bool shouldSend =  (!client.second.token.empty()) && (message.receiver.empty() || client.second.username == message.receiver);
-                                if (shouldSend) {
-                                    std::cout << "Sending message to " << client.second.token << std::endl;
-                                    Message responseMessage {
-                                        .type = Message::Type::CHAT,
-                                        .sender = message.sender,
-                                        .receiver = message.receiver,
-                                        .content = message.content,
-                                        .token = client.second.token,
-                                        .timestamp = message.timestamp
-                                    };
-                                    sendMessage(client.first, responseMessage);
-                                }
+                        auto now = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+                        message.sequence = messageStore->append(message.sender, message.receiver, message.content, now);
+                        if (message.sequence == 0) {
+                            // Not stored, so nobody else hears of it either
+                            Message rejectedMessage {
+                                .type = Message::Type::ACK,
+                                .sender = "",
+                                .receiver = message.receiver,
+                                .content = "rejected",
+                                .token = message.token,
+                                .timestamp = std::chrono::system_clock::now()
+                            };
+                            sendTo(clientfd, rejectedMessage);
+                        }
+                        else {
+                            // The sender learns where its message landed, and everyone else
+                            // about the message, once the store has committed it
+                            stored.push_back({clientfd, it->second.connection, message});
+                            it->second.awaitingFlush = true;
+                        }
+                    }
+                    else if (message.type == Message::Type::PING || message.type == Message::Type::PONG) {
+                        // Heartbeats only need to refresh lastActivity
+                    }
+                    else if (message.type == Message::Type::ACK) {
+                        // Receipts always belong to the authenticated user
+                        message.sender = clients[clientfd].username;
+                        bool read = message.content == "read";
+                        Database db;
+                        Statement stmt(db.get(), "INSERT INTO receipts (user_id, conversation, delivered_seq, read_seq) VALUES (?, ?, ?, ?) "
+                             "ON CONFLICT (user_id, conversation) DO UPDATE SET "
+                             "delivered_seq = MAX(delivered_seq, excluded.delivered_seq), "
+                             "read_seq = MAX(read_seq, excluded.read_seq);");
+                        stmt.bindInt(1, userID(db, message.sender));
+                        stmt.bindText(2, message.receiver.empty() ? "#global" : message.receiver);
+                        stmt.bindInt64(3, message.sequence);
+                        stmt.bindInt64(4, read ? message.sequence : 0);
+                        if (sqlite3_step(stmt.get()) != SQLITE_DONE) {
+                            std::cerr << "Error storing receipt" << std::endl;
+                        }
+                        // Let the other side of a direct conversation know
+                        if (!message.receiver.empty() && !isRoom(message.receiver)) {
+                            deliver(message);
+                            if (cluster) {
+                                cluster->relay(message);
                             }
                         }
                     }
@@ -275,6 +1056,9 @@ public:
                                     onlineUsers.insert(client.second.username);
                                 }
                             }
+                            if (cluster) {
+                                onlineUsers.merge(cluster->remoteUsers());
+                            }
 
                             if (onlineUsers.empty()) {
                                 response = "No users online\n";
@@ -294,7 +1078,7 @@ public:
                             };
                             std::cout << "Responding with: " << std::endl;
                             std::cout << response;
-                            sendMessage(clientfd, responseMessage);
+                            sendTo(clientfd, responseMessage);
                         }
                         else if (message.content == "allUsers") {
                             Database db;
@@ -315,33 +1099,74 @@ public:
                             };
                             std::cout << "Responding with: " << std::endl;
                             std::cout << response;
-                            sendMessage(clientfd, responseMessage);
+                            sendTo(clientfd, responseMessage);
                         }
                         else if (message.content == "chat") {
-                            std::cout << "Retreiving chat history between " << message.sender << " and " << message.receiver << std::endl;
+                            std::cout << "Retreiving chat history between " << clients[clientfd].username << " and " << message.receiver << std::endl;
+                            Gathered response;
+                            messageStore->history(clients[clientfd].username, message.receiver, message.sequence, [&](int64_t sequence, int64_t timestamp, std::string_view sender, std::string_view content) {
+                                addHistoryLine(response, sequence, timestamp, sender, "", content);
+                            });
+                            Message responseMessage {
+                                .type = Message::Type::COMMAND,
+                                .sender = "",
+                                .receiver = "",
+                                .content = "",
+                                .token = message.token,
+                                .timestamp = std::chrono::system_clock::now()
+                            };
+                            sendGathered(clientfd, responseMessage, response);
+                        }
+                        else if (message.content == "globalChat") {
+                            // Retrieve global chat history
+                            Gathered response;
+                            messageStore->history(clients[clientfd].username, "", message.sequence, [&](int64_t sequence, int64_t timestamp, std::string_view sender, std::string_view content) {
+                                addHistoryLine(response, sequence, timestamp, sender, "", content);
+                            });
+                            Message responseMessage {
+                                .type = Message::Type::COMMAND,
+                                .sender = "",
+                                .receiver = "",
+                                .content = "",
+                                .token = message.token,
+                                .timestamp = std::chrono::system_clock::now()
+                            };
+                            sendGathered(clientfd, responseMessage, response);
+                        }
+                        else if (message.content == "stats") {
+                            // Connection counts, then "<limit> <rate>/<burst> <allowed> <throttled> <keys>" per limiter
+                            std::string response = "connections " + std::to_string(clients.size()) + "/" + std::to_string(maxConnections) + "\n";
+                            response += "rejected " + std::to_string(connectionsRejected) + "\n";
+                            response += "delayedAccepts " + std::to_string(acceptsDelayed) + "\n";
+                            for (const auto& limiter : limiters) {
+                                RateLimit limit = limiter.second.limit();
+                                response += limiter.first + " ";
+                                response += limit.rate > 0 ? std::to_string(limit.rate) + "/" + std::to_string(limit.burst) : "off";
+                                response += " " + std::to_string(limiter.second.allowed()) + " " + std::to_string(limiter.second.throttled()) + " " + std::to_string(limiter.second.keys()) + "\n";
+                            }
+                            Message responseMessage {
+                                .type = Message::Type::COMMAND,
+                                .sender = "",
+                                .receiver = "",
+                                .content = response,
+                                .token = message.token,
+                                .timestamp = std::chrono::system_clock::now()
+                            };
+                            sendTo(clientfd, responseMessage);
+                        }
+                        else if (message.content == "rooms") {
+                            // name, member count and whether the user is a member
                             Database db;
-                            Statement stmt(db.get(), "SELECT u1.username AS sender, u2.username AS receiver, m.message, m.timestamp "
-                                 "FROM messages m "
-                                 "JOIN users u1 ON m.sender_id = u1.id "
-                                 "JOIN users u2 ON m.receiver_id = u2.id "
-                                 "WHERE (u1.username = ? AND u2.username = ?) "
-                                 "OR (u1.username = ? AND u2.username = ?) "
-                                 "ORDER BY m.timestamp;");
-
-                            // Bind the parameters
-                            stmt.bindText(1, message.sender);
-                            stmt.bindText(2, message.receiver);
-                            stmt.bindText(3, message.receiver);
-                            stmt.bindText(4, message.sender);
+                            Statement stmt(db.get(), "SELECT '#' || r.name, COUNT(m.user_id), COALESCE(SUM(m.user_id = ?), 0) "
+                                 "FROM rooms r "
+                                 "LEFT JOIN room_members m ON m.room_id = r.id "
+                                 "GROUP BY r.id "
+                                 "ORDER BY r.name;");
+                            stmt.bindInt(1, userID(db, clients[clientfd].username));
                             std::string response = "";
                             while (stmt.step()) {
-                                const char* sender = stmt.getColumnText(0);
-                                const char* receiver = stmt.getColumnText(1);
-                                const char* message = stmt.getColumnText(2);
-                                const char* timestamp = stmt.getColumnText(3);
-                                response += std::string(timestamp) + " " + std::string(sender) + " " + std::string(message) + "\n";
+                                response += std::string(stmt.getColumnText(0)) + " " + stmt.getColumnText(1) + " " + stmt.getColumnText(2) + "\n";
                             }
-                            std::cout << response << std::endl;
                             Message responseMessage {
                                 .type = Message::Type::COMMAND,
                                 .sender = "",
@@ -350,33 +1175,235 @@ public:
                                 .token = message.token,
                                 .timestamp = std::chrono::system_clock::now()
                             };
-                            sendMessage(clientfd, responseMessage);
+                            sendTo(clientfd, responseMessage);
                         }
-                        else if (message.content == "globalChat") {
-                            // Retrieve global chat history
-                            Database db;
-                            
-                            Statement stmt(db.get(), "SELECT u.username, m.message, m.timestamp "
-                                 "FROM global_messages m "
-                                 "JOIN users u ON m.sender_id = u.id "
-                                 "ORDER BY m.timestamp;");
+                        else if (message.content == "joinRoom" || message.content == "leaveRoom") {
+                            // receiver is "#<room name>"; joining creates the room if needed
+                            const std::string& username = clients[clientfd].username;
+                            const std::string& room = message.receiver;
+                            bool join = message.content == "joinRoom";
+                            std::string response;
+                            if (!isRoom(room) || room.size() < 2 || room == "#global" || std::any_of(room.begin(), room.end(), ::isspace)) {
+                                response = "Invalid room name";
+                            }
+                            else {
+                                Database db;
+                                int memberID = userID(db, username);
+                                int result;
+                                if (join) {
+                                    Statement create(db.get(), "INSERT OR IGNORE INTO rooms (name) VALUES (?);");
+                                    create.bindText(1, room.substr(1));
+                                    result = sqlite3_step(create.get());
+                                    if (result == SQLITE_DONE) {
+                                        Statement stmt(db.get(), "INSERT OR IGNORE INTO room_members (room_id, user_id) SELECT id, ? FROM rooms WHERE name = ?;");
+                                        stmt.bindInt(1, memberID);
+                                        stmt.bindText(2, room.substr(1));
+                                        result = sqlite3_step(stmt.get());
+                                    }
+                                }
+                                else {
+                                    Statement stmt(db.get(), "DELETE FROM room_members WHERE user_id = ? AND room_id = (SELECT id FROM rooms WHERE name = ?);");
+                                    stmt.bindInt(1, memberID);
+                                    stmt.bindText(2, room.substr(1));
+                                    result = sqlite3_step(stmt.get());
+                                }
+                                if (result != SQLITE_DONE) {
+                                    std::cerr << "Error updating room members: " << sqlite3_errmsg(db.get()) << std::endl;
+                                    response = (join ? "Could not join " : "Could not leave ") + room;
+                                }
+                                else {
+                                    followMembership(username, room, join);
+                                    if (cluster) {
+                                        cluster->relayMembership(username, room, join);
+                                    }
+                                    response = (join ? "Joined " : "Left ") + room;
+                                }
+                            }
+                            std::cout << username << ": " << response << std::endl;
+                            Message responseMessage {
+                                .type = Message::Type::COMMAND,
+                                .sender = "",
+                                .receiver = room,
+                                .content = response,
+                                .token = message.token,
+                                .timestamp = std::chrono::system_clock::now()
+                            };
+                            sendTo(clientfd, responseMessage);
+                        }
+                        else if (message.content == "roomChat") {
+                            // Retrieve room history, members only
+                            Gathered response;
+                            if (subscribed(clientfd, message.receiver)) {
+                                messageStore->history(clients[clientfd].username, message.receiver, message.sequence, [&](int64_t sequence, int64_t timestamp, std::string_view sender, std::string_view content) {
+                                    addHistoryLine(response, sequence, timestamp, sender, "", content);
+                                });
+                            }
+                            Message responseMessage {
+                                .type = Message::Type::COMMAND,
+                                .sender = "",
+                                .receiver = "",
+                                .content = "",
+                                .token = message.token,
+                                .timestamp = std::chrono::system_clock::now()
+                            };
+                            sendGathered(clientfd, responseMessage, response);
+                        }
+                        else if (message.content == "sync") {
+                            const std::string& username = clients[clientfd].username;
+                            // receiver holds a "<sequence> <conversation>" line for every conversation the client has
+                            std::unordered_map<std::string, int64_t> seen;
+                            size_t start = 0;
+                            while (start < message.receiver.size()) {
+                                size_t end = message.receiver.find('\n', start);
+                                if (end == std::string::npos) {
+                                    end = message.receiver.size();
+                                }
+                                std::string line = message.receiver.substr(start, end - start);
+                                size_t space = line.find(' ');
+                                if (space != std::string::npos) {
+                                    seen[line.substr(space + 1)] = std::atoll(line.c_str());
+                                }
+                                start = end + 1;
+                            }
 
-                            std::string response = "";
+                            // Conversations the client did not mention resume after the last acknowledged delivery
+                            Database db;
+                            Statement stmt(db.get(), "SELECT conversation, delivered_seq FROM receipts WHERE user_id = ?;");
+                            stmt.bindInt(1, userID(db, username));
                             while (stmt.step()) {
-                                const char* sender = stmt.getColumnText(0);
-                                const char* message = stmt.getColumnText(1);
-                                const char* timestamp = stmt.getColumnText(2);
-                                response += std::string(timestamp) + " " + std::string(sender) + " " + std::string(message) + "\n";
+                                seen.emplace(stmt.getColumnText(0), sqlite3_column_int64(stmt.get(), 1));
+                            }
+
+                            Gathered response;
+                            size_t missed = 0;
+                            auto appendMissed = [&](const std::string& other, int64_t afterSequence) {
+                                const std::string conversation = other.empty() ? "#global" : other;
+                                messageStore->history(username, other, afterSequence, [&](int64_t sequence, int64_t timestamp, std::string_view sender, std::string_view content) {
+                                    addHistoryLine(response, sequence, timestamp, sender, conversation, content);
+                                    missed++;
+                                });
+                            };
+                            for (const auto& conversation : messageStore->conversations(username)) {
+                                auto known = seen.find(conversation.first);
+                                int64_t afterSequence = known == seen.end() ? 0 : known->second;
+                                if (conversation.second > afterSequence) {
+                                    appendMissed(conversation.first, afterSequence);
+                                }
                             }
+                            // Like the global chatroom, rooms are only synced once the client has seen them
+                            auto global = seen.find("#global");
+                            if (global != seen.end()) {
+                                appendMissed("", global->second);
+                            }
+                            for (const auto& room : clients[clientfd].rooms) {
+                                auto known = seen.find(room);
+                                if (known != seen.end()) {
+                                    appendMissed(room, known->second);
+                                }
+                            }
+                            std::cout << "Sync for " << username << ": " << missed << " missed messages" << std::endl;
                             Message responseMessage {
                                 .type = Message::Type::COMMAND,
                                 .sender = "",
                                 .receiver = "",
+                                .content = "",
+                                .token = message.token,
+                                .timestamp = std::chrono::system_clock::now()
+                            };
+                            sendGathered(clientfd, responseMessage, response);
+                        }
+                        else if (message.content == "search" || message.content.rfind("search ", 0) == 0) {
+                            // content is "search" for the first page, "search <cursor>" for the
+                            // ones after it; the query is in receiver
+                            bool paged = message.content.size() > 7;
+                            double afterScore = 0;
+                            std::string afterID;
+                            std::string terms = toMatchQuery(message.receiver);
+                            // Scope by the authenticated user, not by whatever the client put in sender
+                            const std::string& username = clients[clientfd].username;
+                            std::cout << "Searching messages of " << username << " for \"" << message.receiver << "\"" << std::endl;
+                            if (!messageStore->searchable()) {
+                                refuse(clientfd, message, "search is not available with this storage engine");
+                                it++;
+                                continue;
+                            }
+                            std::string response = "";
+                            std::string cursor = "";
+                            if (!terms.empty() && (!paged || parseSearchCursor(message.content.substr(7), afterScore, afterID))) {
+                                Database db;
+                                int searcherID = userID(db, username);
+                                std::string rooms = "";
+                                Statement roomsStmt(db.get(), "SELECT room_id FROM room_members WHERE user_id = ?;");
+                                roomsStmt.bindInt(1, searcherID);
+                                while (roomsStmt.step()) {
+                                    rooms += std::string(rooms.empty() ? "" : " OR ") + "r" + roomsStmt.getColumnText(0);
+                                }
+
+                                // Every match of every source is ranked, and pages are cut by
+                                // (score, id) rather than an offset, so each page continues exactly
+                                // where the one before it ended however far down the results go.
+                                std::string sql = "SELECT id, timestamp, sender, conversation, message, score FROM ("
+                                     "SELECT 'm' || m.id AS id, m.timestamp, u1.username AS sender, "
+                                     "CASE WHEN m.sender_id = ?1 THEN u2.username ELSE u1.username END AS conversation, "
+                                     "m.message, c.score "
+                                     "FROM (SELECT rowid, bm25(messages_fts, 1.0, 0.0) AS score FROM messages_fts "
+                                     "WHERE messages_fts MATCH ?2) c "
+                                     "JOIN messages m ON m.id = c.rowid "
+                                     "JOIN users u1 ON m.sender_id = u1.id "
+                                     "JOIN users u2 ON m.receiver_id = u2.id "
+                                     "UNION ALL "
+                                     "SELECT 'g' || g.id, g.timestamp, u.username, '#global', g.message, c.score "
+                                     "FROM (SELECT rowid, bm25(global_messages_fts) AS score FROM global_messages_fts "
+                                     "WHERE global_messages_fts MATCH ?3) c "
+                                     "JOIN global_messages g ON g.id = c.rowid "
+                                     "JOIN users u ON g.sender_id = u.id ";
+                                if (!rooms.empty()) {
+                                    sql += "UNION ALL "
+                                         "SELECT 'r' || r.id, r.timestamp, u.username, '#' || rm.name, r.message, c.score "
+                                         "FROM (SELECT rowid, bm25(room_messages_fts, 1.0, 0.0) AS score FROM room_messages_fts "
+                                         "WHERE room_messages_fts MATCH ?4) c "
+                                         "JOIN room_messages r ON r.id = c.rowid "
+                                         "JOIN rooms rm ON rm.id = r.room_id "
+                                         "JOIN users u ON r.sender_id = u.id ";
+                                }
+                                sql += ") WHERE ?5 = 0 OR (score, id) > (?6, ?7) "
+                                     "ORDER BY score, id "
+                                     "LIMIT ?8;";
+                                Statement stmt(db.get(), sql);
+                                stmt.bindInt(1, searcherID);
+                                stmt.bindText(2, "message : (" + terms + ") AND participants : u" + std::to_string(searcherID));
+                                stmt.bindText(3, terms);
+                                stmt.bindText(4, "message : (" + terms + ") AND room : (" + rooms + ")");
+                                stmt.bindInt(5, paged ? 1 : 0);
+                                stmt.bindDouble(6, afterScore);
+                                stmt.bindText(7, afterID);
+                                stmt.bindInt(8, SEARCH_PAGE_SIZE);
+
+                                int results = 0;
+                                while (stmt.step()) {
+                                    const char* id = stmt.getColumnText(0);
+                                    const char* timestamp = stmt.getColumnText(1);
+                                    const char* sender = stmt.getColumnText(2);
+                                    const char* conversation = stmt.getColumnText(3);
+                                    const char* text = stmt.getColumnText(4);
+                                    response += std::string(id) + " " + std::string(timestamp) + " " + std::string(sender) + " " + std::string(conversation) + " " + std::string(text) + "\n";
+                                    if (++results == SEARCH_PAGE_SIZE) {
+                                        // Printed so it reads back as exactly the same double
+                                        char score[32];
+                                        snprintf(score, sizeof(score), "%.17g", sqlite3_column_double(stmt.get(), 5));
+                                        cursor = std::string(score) + " " + id;
+                                    }
+                                }
+                            }
+                            Message responseMessage {
+                                .type = Message::Type::COMMAND,
+                                .sender = "",
+                                .receiver = cursor,
                                 .content = response,
                                 .token = message.token,
                                 .timestamp = std::chrono::system_clock::now()
                             };
-                            sendMessage(clientfd, responseMessage);
+                            sendTo(clientfd, responseMessage);
                         }
                     }
 
@@ -384,14 +1411,25 @@ public:
                 it++;
             }
 
+            // A store that committed on append has nothing to wait for
+            if (!messageStore->groupCommitted()) {
+                releaseStored();
+            }
         }
     }
 
 };
 
+void usage(const char* program) {
+    std::cerr << "Usage: " << program << " <port> [sqlite|log] [--node <host:port> --peer <host:port>... --cluster-secret <file>]" << std::endl;
+    std::cerr << "       [--handoff <socket path>]" << std::endl;
+    std::cerr << "       [--limit <ip|auth|user|chat|command|accept>=<rate>/<burst>|off...] [--max-connections <n>]" << std::endl;
+    std::cerr << "       [--capture <file>] [--tls-cert <file> --tls-key <file>]" << std::endl;
+}
+
 int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        std::cerr << "Usage: " << argv[0] << " <port>" << std::endl;
+    if (argc < 2) {
+        usage(argv[0]);
         return 1;
     }
     try {
@@ -400,8 +1438,119 @@ int main(int argc, char *argv[]) {
             std::cerr << "Invalid port number" << std::endl;
             return 1;
         }
-        ChatServer server(port);
-        server.run();
+        std::string engine = "sqlite";
+        std::string nodeAddress = "";
+        std::vector<std::string> peers;
+        std::string secretPath = "";
+        std::string handoffPath = "";
+        std::vector<std::pair<std::string, RateLimit>> limits;
+        int maxConnections = DEFAULT_MAX_CONNECTIONS;
+        std::string capturePath = "";
+        std::string tlsCert = "";
+        std::string tlsKey = "";
+        for (int i = 2; i < argc; i++) {
+            std::string arg = argv[i];
+            if (arg == "--node" && i + 1 < argc) {
+                nodeAddress = argv[++i];
+            }
+            else if (arg == "--peer" && i + 1 < argc) {
+                peers.push_back(argv[++i]);
+            }
+            else if (arg == "--cluster-secret" && i + 1 < argc) {
+                secretPath = argv[++i];
+            }
+            else if (arg == "--handoff" && i + 1 < argc) {
+                handoffPath = argv[++i];
+            }
+            else if (arg == "--limit" && i + 1 < argc) {
+                std::string limit = argv[++i];
+                size_t equals = limit.find('=');
+                RateLimit rateLimit;
+                if (equals == std::string::npos || !parseRateLimit(limit.substr(equals + 1), rateLimit)) {
+                    std::cerr << "Invalid limit " << limit << std::endl;
+                    return 1;
+                }
+                limits.push_back({limit.substr(0, equals), rateLimit});
+            }
+            else if (arg == "--tls-cert" && i + 1 < argc) {
+                tlsCert = argv[++i];
+            }
+            else if (arg == "--tls-key" && i + 1 < argc) {
+                tlsKey = argv[++i];
+            }
+            else if (arg == "--capture" && i + 1 < argc) {
+                capturePath = argv[++i];
+            }
+            else if (arg == "--max-connections" && i + 1 < argc) {
+                maxConnections = std::stoi(argv[++i]);
+            }
+            else if (i == 2 && arg.rfind("--", 0) != 0) {
+                engine = arg;
+            }
+            else {
+                usage(argv[0]);
+                return 1;
+            }
+        }
+        if (nodeAddress.empty() && (!peers.empty() || !secretPath.empty())) {
+            std::cerr << "--peer and --cluster-secret require --node" << std::endl;
+            return 1;
+        }
+        // Nodes prove to each other that they belong to the cluster with the
+        // first line of this file, which every node must have
+        std::string clusterSecret = "";
+        if (!nodeAddress.empty()) {
+            std::ifstream secretFile(secretPath);
+            if (secretPath.empty() || !std::getline(secretFile, clusterSecret) || clusterSecret.empty()) {
+                std::cerr << "--node requires a --cluster-secret file with the secret on its first line" << std::endl;
+                return 1;
+            }
+        }
+        // Sequence numbers and history of the log engine are local to one node,
+        // while cluster nodes answer for the same conversations
+        if (!nodeAddress.empty() && engine == "log") {
+            std::cerr << "The log storage engine cannot be used with --node" << std::endl;
+            return 1;
+        }
+        if (tlsCert.empty() != tlsKey.empty()) {
+            std::cerr << "--tls-cert and --tls-key go together" << std::endl;
+            return 1;
+        }
+
+        // A client that disconnects while a reply is being written must not take the server down
+        signal(SIGPIPE, SIG_IGN);
+
+        // A server already running on the handoff socket gives us its connections.
+        // Storage is only opened once it has exited and let go of it.
+        HandoffState inherited;
+        bool takeOver = !handoffPath.empty() && receiveHandoff(handoffPath, inherited);
+
+        std::unique_ptr<MessageStore> store = makeMessageStore(engine);
+        if (!store) {
+            std::cerr << "Unknown storage engine " << engine << std::endl;
+            return 1;
+        }
+        std::unique_ptr<ChatServer> server = takeOver ? std::make_unique<ChatServer>(inherited, std::move(store)) : std::make_unique<ChatServer>(port, std::move(store));
+        for (const auto& limit : limits) {
+            if (!server->setLimit(limit.first, limit.second)) {
+                std::cerr << "Unknown limit " << limit.first << std::endl;
+                return 1;
+            }
+        }
+        server->setMaxConnections(std::max(1, maxConnections));
+        if (!capturePath.empty()) {
+            server->captureTo(capturePath, takeOver);
+        }
+        if (!tlsCert.empty()) {
+            server->useTls(tlsCert, tlsKey);
+        }
+        if (!handoffPath.empty()) {
+            server->listenForHandoff(handoffPath);
+        }
+        if (!nodeAddress.empty()) {
+            server->joinCluster(nodeAddress, peers, clusterSecret);
+        }
+        server->run();
     }
     catch (const std::exception &e) {
         std::cerr << "Error: " << e.what() << std::endl;
@@ -409,4 +1558,4 @@ int main(int argc, char *argv[]) {
     }
 
     return 0;
-}
\ No newline at end of file
+}
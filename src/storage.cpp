@@ -0,0 +1,594 @@
+#include "storage.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+
+const std::string LOG_DIRECTORY = "../var/log";
+
+int64_t SqliteMessageStore::append(const std::string& sender, const std::string& receiver, const std::string& content, int64_t timestamp) {
+    int senderID = userID(db, sender);
+    // Taking the next sequence number and storing the message is one transaction,
+    // which also keeps nodes sharing this database from handing out the same number
+    if (sqlite3_exec(db.get(), "BEGIN IMMEDIATE", NULL, NULL, NULL) != SQLITE_OK) {
+        std::cerr << "Error starting transaction: " << sqlite3_errmsg(db.get()) << std::endl;
+        return 0;
+    }
+    int64_t sequence = 0;
+    int result;
+    if (isRoom(receiver)) {
+        Statement next(db.get(), "UPDATE rooms SET last_seq = last_seq + 1 WHERE name = ? RETURNING id, last_seq;");
+        next.bindText(1, receiver.substr(1));
+        int roomID = -1;
+        if (next.step()) {
+            roomID = sqlite3_column_int(next.get(), 0);
+            sequence = sqlite3_column_int64(next.get(), 1);
+        }
+        next.reset();
+        Statement stmt(db.get(), "INSERT INTO room_messages (room_id, sender_id, message, timestamp, seq) VALUES (?, ?, ?, ?, ?)");
+        stmt.bindInt(1, roomID);
+        stmt.bindInt(2, senderID);
+        stmt.bindText(3, content);
+        stmt.bindInt64(4, timestamp);
+        stmt.bindInt64(5, sequence);
+        result = sqlite3_step(stmt.get());
+    }
+    else if (receiver.empty()) {
+        sequence = nextSequence(0, 0);
+        Statement stmt(db.get(), "INSERT INTO global_messages (sender_id, message, timestamp, seq) VALUES (?, ?, ?, ?)");
+        stmt.bindInt(1, senderID);
+        stmt.bindText(2, content);
+        stmt.bindInt64(3, timestamp);
+        stmt.bindInt64(4, sequence);
+        result = sqlite3_step(stmt.get());
+    }
+    else {
+        int receiverID = userID(db, receiver);
+        sequence = nextSequence(std::min(senderID, receiverID), std::max(senderID, receiverID));
+        Statement stmt(db.get(), "INSERT INTO messages (sender_id, receiver_id, message, timestamp, seq) VALUES (?, ?, ?, ?, ?)");
+        stmt.bindInt(1, senderID);
+        stmt.bindInt(2, receiverID);
+        stmt.bindText(3, content);
+        stmt.bindInt64(4, timestamp);
+        stmt.bindInt64(5, sequence);
+        result = sqlite3_step(stmt.get());
+    }
+    if (sequence == 0 || result != SQLITE_DONE) {
+        std::cerr << "Error inserting message into db" << std::endl;
+        sqlite3_exec(db.get(), "ROLLBACK", NULL, NULL, NULL);
+        return 0;
+    }
+    if (sqlite3_exec(db.get(), "COMMIT", NULL, NULL, NULL) != SQLITE_OK) {
+        std::cerr << "Error committing message: " << sqlite3_errmsg(db.get()) << std::endl;
+        sqlite3_exec(db.get(), "ROLLBACK", NULL, NULL, NULL);
+        return 0;
+    }
+    return sequence;
+}
+
+int64_t SqliteMessageStore::nextSequence(int user1ID, int user2ID) {
+    Statement stmt(db.get(), "INSERT INTO sequences (user1_id, user2_id, last_seq) VALUES (?, ?, 1) "
+         "ON CONFLICT (user1_id, user2_id) DO UPDATE SET last_seq = last_seq + 1 "
+         "RETURNING last_seq;");
+    stmt.bindInt(1, user1ID);
+    stmt.bindInt(2, user2ID);
+    int64_t sequence = stmt.step() ? sqlite3_column_int64(stmt.get(), 0) : 0;
+    stmt.reset();
+    return sequence;
+}
+
+void SqliteMessageStore::history(const std::string& user1, const std::string& user2, int64_t afterSequence, const HistoryVisitor& visit) {
+    if (isRoom(user2)) {
+        Statement stmt(db.get(), "SELECT u.username, m.message, m.timestamp, m.seq "
+             "FROM room_messages m "
+             "JOIN users u ON m.sender_id = u.id "
+             "WHERE m.room_id = (SELECT id FROM rooms WHERE name = ?) AND m.seq > ? "
+             "ORDER BY m.seq;");
+        stmt.bindText(1, user2.substr(1));
+        stmt.bindInt64(2, afterSequence);
+        while (stmt.step()) {
+            visit(sqlite3_column_int64(stmt.get(), 3), sqlite3_column_int64(stmt.get(), 2), stmt.getColumnText(0), stmt.getColumnText(1));
+        }
+        return;
+    }
+    if (user2.empty()) {
+        Statement stmt(db.get(), "SELECT u.username, m.message, m.timestamp, m.seq "
+             "FROM global_messages m "
+             "JOIN users u ON m.sender_id = u.id "
+             "WHERE m.seq > ? "
+             "ORDER BY m.seq;");
+        stmt.bindInt64(1, afterSequence);
+        while (stmt.step()) {
+            visit(sqlite3_column_int64(stmt.get(), 3), sqlite3_column_int64(stmt.get(), 2), stmt.getColumnText(0), stmt.getColumnText(1));
+        }
+        return;
+    }
+    Statement stmt(db.get(), "SELECT u.username AS sender, m.message, m.timestamp, m.seq "
+         "FROM messages m "
+         "JOIN users u ON m.sender_id = u.id "
+         "WHERE ((m.sender_id = ?1 AND m.receiver_id = ?2) "
+         "OR (m.sender_id = ?2 AND m.receiver_id = ?1)) "
+         "AND m.seq > ?3 "
+         "ORDER BY m.seq;");
+    stmt.bindInt(1, userID(db, user1));
+    stmt.bindInt(2, userID(db, user2));
+    stmt.bindInt64(3, afterSequence);
+    while (stmt.step()) {
+        visit(sqlite3_column_int64(stmt.get(), 3), sqlite3_column_int64(stmt.get(), 2), stmt.getColumnText(0), stmt.getColumnText(1));
+    }
+}
+
+std::vector<std::pair<std::string, int64_t>> SqliteMessageStore::conversations(const std::string& user) {
+    Statement stmt(db.get(), "SELECT u.username, s.last_seq "
+         "FROM sequences s "
+         "JOIN users u ON u.id = CASE WHEN s.user1_id = ?1 THEN s.user2_id ELSE s.user1_id END "
+         "WHERE s.user1_id = ?1 OR s.user2_id = ?1;");
+    stmt.bindInt(1, userID(db, user));
+    std::vector<std::pair<std::string, int64_t>> result;
+    while (stmt.step()) {
+        result.emplace_back(stmt.getColumnText(0), sqlite3_column_int64(stmt.get(), 1));
+    }
+    return result;
+}
+
+namespace {
+
+const uint32_t NO_SEGMENT = UINT32_MAX;
+// Indexes of an older layout are ignored and their segments scanned instead
+const uint32_t INDEX_VERSION = 2;
+
+// On-disk record layout, followed by sender, receiver and content bytes and
+// zero padding up to a multiple of 8. A length of 0 marks the end of a segment.
+struct RecordHeader {
+    uint32_t length;
+    uint32_t checksum; // crc32 of everything after this field, padding included
+    uint32_t prevSegment;
+    uint32_t prevOffset;
+    int64_t timestamp;
+    int64_t sequence;
+    uint16_t senderLength;
+    uint16_t receiverLength; // 0 for the global chatroom
+    uint32_t contentLength;
+};
+static_assert(sizeof(RecordHeader) == 40);
+
+uint32_t crc32(const char* data, size_t size) {
+    static uint32_t table[256];
+    static bool initialized = false;
+    if (!initialized) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) {
+                c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+            }
+            table[i] = c;
+        }
+        initialized = true;
+    }
+    uint32_t crc = 0xFFFFFFFF;
+    for (size_t i = 0; i < size; i++) {
+        crc = table[(crc ^ static_cast<uint8_t>(data[i])) & 0xFF] ^ (crc >> 8);
+    }
+    return crc ^ 0xFFFFFFFF;
+}
+
+uint32_t recordLength(size_t payload) {
+    return static_cast<uint32_t>((sizeof(RecordHeader) + payload + 7) & ~static_cast<size_t>(7));
+}
+
+uint32_t checksumOf(const char* record, uint32_t length) {
+    return crc32(record + 2 * sizeof(uint32_t), length - 2 * sizeof(uint32_t));
+}
+
+}
+
+LogMessageStore::LogMessageStore(const std::string& directory) : directory(directory) {
+    std::error_code error;
+    std::filesystem::create_directories(directory, error);
+    if (error) {
+        std::cerr << "Error creating log directory " << directory << std::endl;
+        exit(1);
+    }
+
+    std::vector<uint32_t> ids;
+    for (const auto& entry : std::filesystem::directory_iterator(directory)) {
+        if (entry.path().extension() == ".seg") {
+            ids.push_back(static_cast<uint32_t>(std::stoul(entry.path().stem().string())));
+        }
+    }
+    std::sort(ids.begin(), ids.end());
+    if (ids.empty()) {
+        openSegment(0, true);
+        return;
+    }
+    for (size_t i = 1; i < ids.size(); i++) {
+        if (ids[i] != ids[i - 1] + 1) {
+            std::cerr << "Missing log segment " << ids[i - 1] + 1 << std::endl;
+            exit(1);
+        }
+    }
+    for (uint32_t id : ids) {
+        openSegment(id, false);
+    }
+
+    // Start from the newest sealed segment with a readable index and only scan what follows it
+    size_t scanFrom = 0;
+    for (size_t i = segments.size(); i-- > 0; ) {
+        if (loadIndex(segments[i].id)) {
+            scanFrom = i + 1;
+            break;
+        }
+    }
+    for (size_t i = scanFrom; i < segments.size(); i++) {
+        writeOffset = scanSegment(segments[i]);
+    }
+    if (scanFrom == segments.size()) {
+        // The newest segment was sealed but its successor was never created
+        openSegment(segments.back().id + 1, true);
+        writeOffset = 0;
+    }
+    std::cout << "Recovered " << heads.size() << " conversations from " << segments.size() << " log segments" << std::endl;
+}
+
+LogMessageStore::~LogMessageStore() {
+    flush();
+    for (auto& segment : segments) {
+        munmap(const_cast<char*>(segment.data), SEGMENT_SIZE);
+        close(segment.fd);
+    }
+}
+
+int64_t LogMessageStore::append(const std::string& sender, const std::string& receiver, const std::string& content, int64_t timestamp) {
+    if (sender.size() > UINT16_MAX || receiver.size() > UINT16_MAX) {
+        return 0;
+    }
+    uint32_t length = recordLength(sender.size() + receiver.size() + content.size());
+    if (content.size() >= SEGMENT_SIZE || length > SEGMENT_SIZE) {
+        std::cerr << "Message too large for the log" << std::endl;
+        return 0;
+    }
+    if (writeOffset + pending.size() + length > SEGMENT_SIZE) {
+        rotate();
+    }
+
+    std::string key = conversationKey(sender, receiver);
+    Location location = {segments.back().id, static_cast<uint32_t>(writeOffset + pending.size())};
+    RecordHeader header = {
+        .length = length,
+        .checksum = 0,
+        .prevSegment = NO_SEGMENT,
+        .prevOffset = 0,
+        .timestamp = timestamp,
+        .sequence = 1,
+        .senderLength = static_cast<uint16_t>(sender.size()),
+        .receiverLength = static_cast<uint16_t>(receiver.size()),
+        .contentLength = static_cast<uint32_t>(content.size())
+    };
+    Head& head = headOf(key);
+    if (head.sequence > 0) {
+        header.prevSegment = head.location.segment;
+        header.prevOffset = head.location.offset;
+        header.sequence = head.sequence + 1;
+    }
+
+    size_t start = pending.size();
+    pending.append(reinterpret_cast<const char*>(&header), sizeof(header));
+    pending += sender;
+    pending += receiver;
+    pending += content;
+    pending.resize(start + length, '\0');
+    uint32_t checksum = checksumOf(&pending[start], length);
+    std::memcpy(&pending[start + offsetof(RecordHeader, checksum)], &checksum, sizeof(checksum));
+
+    advance(head, location, header.sequence);
+    return header.sequence;
+}
+
+void LogMessageStore::history(const std::string& user1, const std::string& user2, int64_t afterSequence, const HistoryVisitor& visit) {
+    auto found = heads.find(conversationKey(user1, user2));
+    if (found == heads.end() || found->second.sequence <= afterSequence) {
+        return;
+    }
+    const Head& head = found->second;
+    // Stretch i runs from checkpoint i up to the record before checkpoint i + 1.
+    // Each is walked newest to oldest along the chain, then replayed in order.
+    std::vector<const RecordHeader*> records;
+    for (size_t i = std::max<int64_t>(afterSequence, 0) / CHECKPOINT_INTERVAL; i < head.checkpoints.size(); i++) {
+        Location first = head.checkpoints[i];
+        Location location = head.location;
+        if (i + 1 < head.checkpoints.size()) {
+            const RecordHeader* next = reinterpret_cast<const RecordHeader*>(recordAt(head.checkpoints[i + 1]));
+            location = {next->prevSegment, next->prevOffset};
+        }
+        // Appends only move forward, so the stretch lies between its first and
+        // last record; have it read in one go rather than a page fault per record
+        if (first.segment == location.segment && location.offset - first.offset <= SEGMENT_SIZE / 16 && committed(location)) {
+            const char* data = segments[first.segment - segments.front().id].data;
+            size_t start = first.offset & ~static_cast<size_t>(getpagesize() - 1);
+            madvise(const_cast<char*>(data) + start, location.offset + sizeof(RecordHeader) - start, MADV_WILLNEED);
+        }
+        records.clear();
+        while (location.segment != NO_SEGMENT) {
+            const RecordHeader* record = reinterpret_cast<const RecordHeader*>(recordAt(location));
+            if (record->sequence <= afterSequence) {
+                break;
+            }
+            // The newest records may not be committed yet, only their links are followed
+            if (committed(location)) {
+                records.push_back(record);
+            }
+            if (location.segment == first.segment && location.offset == first.offset) {
+                break;
+            }
+            location = {record->prevSegment, record->prevOffset};
+        }
+        for (auto it = records.rbegin(); it != records.rend(); it++) {
+            const char* payload = reinterpret_cast<const char*>(*it) + sizeof(RecordHeader);
+            std::string_view sender(payload, (*it)->senderLength);
+            std::string_view content(payload + (*it)->senderLength + (*it)->receiverLength, (*it)->contentLength);
+            visit((*it)->sequence, (*it)->timestamp, sender, content);
+        }
+    }
+}
+
+std::vector<std::pair<std::string, int64_t>> LogMessageStore::conversations(const std::string& user) {
+    std::vector<std::pair<std::string, int64_t>> result;
+    auto found = partners.find(user);
+    if (found != partners.end()) {
+        for (const auto& partner : found->second) {
+            result.emplace_back(partner.first, partner.second->sequence);
+        }
+    }
+    return result;
+}
+
+void LogMessageStore::flush() {
+    if (pending.empty()) {
+        return;
+    }
+    int fd = segments.back().fd;
+    size_t written = 0;
+    while (written < pending.size()) {
+        ssize_t result = pwrite(fd, pending.data() + written, pending.size() - written, writeOffset + written);
+        if (result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            std::cerr << "Error writing to log segment" << std::endl;
+            exit(1);
+        }
+        written += result;
+    }
+    if (fdatasync(fd) < 0) {
+        std::cerr << "Error syncing log segment" << std::endl;
+        exit(1);
+    }
+    writeOffset += pending.size();
+    pending.clear();
+}
+
+std::string LogMessageStore::conversationKey(const std::string& user1, const std::string& user2) {
+    if (user2.empty() || isRoom(user2)) {
+        return user2;
+    }
+    // Both directions of a direct conversation share one chain
+    return user1 < user2 ? user1 + '\0' + user2 : user2 + '\0' + user1;
+}
+
+// Uncommitted records are read from pending, everything else from the mapping
+const char* LogMessageStore::recordAt(Location location) const {
+    if (!committed(location)) {
+        return pending.data() + (location.offset - writeOffset);
+    }
+    return segments[location.segment - segments.front().id].data + location.offset;
+}
+
+bool LogMessageStore::committed(Location location) const {
+    return location.segment != segments.back().id || location.offset < writeOffset;
+}
+
+// The head of a conversation, a new empty one the first time it is seen
+LogMessageStore::Head& LogMessageStore::headOf(const std::string& key) {
+    auto found = heads.find(key);
+    if (found != heads.end()) {
+        return found->second;
+    }
+    Head& head = heads[key];
+    addPartners(key, head);
+    return head;
+}
+
+// Let both users of a direct conversation find it in partners
+void LogMessageStore::addPartners(const std::string& key, const Head& head) {
+    size_t separator = key.find('\0');
+    if (separator == std::string::npos) {
+        return;
+    }
+    std::string first = key.substr(0, separator);
+    std::string second = key.substr(separator + 1);
+    partners[first].emplace_back(second, &head);
+    partners[second].emplace_back(first, &head);
+}
+
+// Make the record at location the newest of head's conversation
+void LogMessageStore::advance(Head& head, Location location, int64_t sequence) {
+    head.location = location;
+    head.sequence = sequence;
+    if ((sequence - 1) % CHECKPOINT_INTERVAL == 0) {
+        head.checkpoints.push_back(location);
+    }
+}
+
+std::string LogMessageStore::segmentPath(uint32_t id, const char* extension) const {
+    char name[32];
+    snprintf(name, sizeof(name), "%010u%s", id, extension);
+    return directory + "/" + name;
+}
+
+void LogMessageStore::openSegment(uint32_t id, bool create) {
+    std::string path = segmentPath(id, ".seg");
+    int fd = open(path.c_str(), O_RDWR | (create ? O_CREAT : 0), 0644);
+    if (fd < 0) {
+        std::cerr << "Error opening log segment " << path << std::endl;
+        exit(1);
+    }
+    struct stat info;
+    if (fstat(fd, &info) < 0 || (info.st_size < SEGMENT_SIZE && ftruncate(fd, SEGMENT_SIZE) < 0)) {
+        std::cerr << "Error sizing log segment " << path << std::endl;
+        exit(1);
+    }
+    void* data = mmap(NULL, SEGMENT_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        std::cerr << "Error mapping log segment " << path << std::endl;
+        exit(1);
+    }
+    segments.push_back({id, fd, static_cast<const char*>(data)});
+}
+
+uint32_t LogMessageStore::scanSegment(Segment& segment) {
+    uint32_t offset = 0;
+    while (offset + sizeof(RecordHeader) <= SEGMENT_SIZE) {
+        const RecordHeader* record = reinterpret_cast<const RecordHeader*>(segment.data + offset);
+        if (record->length == 0) {
+            return offset;
+        }
+        bool valid = record->length >= sizeof(RecordHeader) && record->length % 8 == 0
+            && record->length <= SEGMENT_SIZE - offset
+            && recordLength(size_t(record->senderLength) + record->receiverLength + record->contentLength) == record->length
+            && checksumOf(segment.data + offset, record->length) == record->checksum;
+        if (!valid) {
+            // Torn write from a crash: drop it and everything after it so stale
+            // bytes can never be mistaken for records once we append over them
+            std::cerr << "Truncating log segment " << segment.id << " at offset " << offset << std::endl;
+            if (fallocate(segment.fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, SEGMENT_SIZE - offset) < 0) {
+                std::cerr << "Error truncating log segment" << std::endl;
+                exit(1);
+            }
+            return offset;
+        }
+        const char* payload = segment.data + offset + sizeof(RecordHeader);
+        std::string sender(payload, record->senderLength);
+        std::string receiver(payload + record->senderLength, record->receiverLength);
+        advance(headOf(conversationKey(sender, receiver)), {segment.id, offset}, record->sequence);
+        offset += record->length;
+    }
+    return offset;
+}
+
+bool LogMessageStore::loadIndex(uint32_t id) {
+    std::ifstream file(segmentPath(id, ".idx"), std::ios::binary);
+    if (!file) {
+        return false;
+    }
+    std::string data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    // version, count, then count * (key length, key, segment, offset, sequence,
+    // checkpoint count, checkpoint count * (segment, offset)), then crc32 of all of that
+    if (data.size() < 3 * sizeof(uint32_t)) {
+        return false;
+    }
+    uint32_t checksum;
+    std::memcpy(&checksum, data.data() + data.size() - sizeof(checksum), sizeof(checksum));
+    if (crc32(data.data(), data.size() - sizeof(checksum)) != checksum) {
+        return false;
+    }
+    size_t position = 0;
+    auto readInt = [&](uint32_t& value) {
+        if (position + sizeof(value) > data.size() - sizeof(checksum)) {
+            return false;
+        }
+        std::memcpy(&value, data.data() + position, sizeof(value));
+        position += sizeof(value);
+        return true;
+    };
+    uint32_t version, count;
+    if (!readInt(version) || version != INDEX_VERSION || !readInt(count)) {
+        return false;
+    }
+    std::unordered_map<std::string, Head> loaded;
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t keyLength;
+        Head head;
+        uint32_t sequenceLow, sequenceHigh;
+        if (!readInt(keyLength) || position + keyLength > data.size() - sizeof(checksum)) {
+            return false;
+        }
+        std::string key = data.substr(position, keyLength);
+        position += keyLength;
+        if (!readInt(head.location.segment) || !readInt(head.location.offset) || !readInt(sequenceLow) || !readInt(sequenceHigh)) {
+            return false;
+        }
+        head.sequence = static_cast<int64_t>((static_cast<uint64_t>(sequenceHigh) << 32) | sequenceLow);
+        uint32_t checkpoints;
+        if (!readInt(checkpoints) || checkpoints != (head.sequence + CHECKPOINT_INTERVAL - 1) / CHECKPOINT_INTERVAL) {
+            return false;
+        }
+        head.checkpoints.resize(checkpoints);
+        for (Location& checkpoint : head.checkpoints) {
+            if (!readInt(checkpoint.segment) || !readInt(checkpoint.offset)) {
+                return false;
+            }
+        }
+        loaded[key] = std::move(head);
+    }
+    heads = std::move(loaded);
+    partners.clear();
+    for (const auto& head : heads) {
+        addPartners(head.first, head.second);
+    }
+    return true;
+}
+
+void LogMessageStore::writeIndex(uint32_t id) {
+    std::string data;
+    auto writeInt = [&](uint32_t value) {
+        data.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    };
+    writeInt(INDEX_VERSION);
+    writeInt(static_cast<uint32_t>(heads.size()));
+    for (const auto& head : heads) {
+        writeInt(static_cast<uint32_t>(head.first.size()));
+        data += head.first;
+        writeInt(head.second.location.segment);
+        writeInt(head.second.location.offset);
+        writeInt(static_cast<uint32_t>(head.second.sequence));
+        writeInt(static_cast<uint32_t>(static_cast<uint64_t>(head.second.sequence) >> 32));
+        writeInt(static_cast<uint32_t>(head.second.checkpoints.size()));
+        for (const Location& checkpoint : head.second.checkpoints) {
+            writeInt(checkpoint.segment);
+            writeInt(checkpoint.offset);
+        }
+    }
+    writeInt(crc32(data.data(), data.size()));
+
+    // Write then rename so a crash never leaves a half written index behind
+    std::string temporary = segmentPath(id, ".idx.tmp");
+    int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || write(fd, data.data(), data.size()) != static_cast<ssize_t>(data.size()) || fsync(fd) < 0) {
+        std::cerr << "Error writing log index" << std::endl;
+        exit(1);
+    }
+    close(fd);
+    std::filesystem::rename(temporary, segmentPath(id, ".idx"));
+}
+
+void LogMessageStore::rotate() {
+    flush();
+    writeIndex(segments.back().id);
+    openSegment(segments.back().id + 1, true);
+    writeOffset = 0;
+}
+
+std::unique_ptr<MessageStore> makeMessageStore(const std::string& engine) {
+    if (engine == "sqlite") {
+        return std::make_unique<SqliteMessageStore>();
+    }
+    if (engine == "log") {
+        return std::make_unique<LogMessageStore>(LOG_DIRECTORY);
+    }
+    return nullptr;
+}
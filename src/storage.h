@@ -0,0 +1,148 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <unordered_map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "database.h"
+#include "utils.h"
+
+// Called once per message of a conversation, oldest first. The views are only
+// valid for the duration of the call.
+using HistoryVisitor = std::function<void(int64_t sequence, int64_t timestamp, std::string_view sender, std::string_view content)>;
+
+// Where chat messages are persisted. An empty receiver means the global chatroom
+// and a receiver starting with '#' is a room.
+//
+// Every conversation numbers its messages 1, 2, 3... in the order they were
+// stored, so clients can ask for exactly what they have not seen yet.
+class MessageStore {
+public:
+    virtual ~MessageStore() = default;
+
+    // Returns the sequence number given to the message, 0 if it was not stored
+    virtual int64_t append(const std::string& sender, const std::string& receiver, const std::string& content, int64_t timestamp) = 0;
+
+    // Visit the messages after afterSequence between user1 and user2 (in either
+    // direction), in the global chatroom when user2 is empty or in room user2.
+    virtual void history(const std::string& user1, const std::string& user2, int64_t afterSequence, const HistoryVisitor& visit) = 0;
+
+    // The other user and latest sequence number of every direct conversation of user
+    virtual std::vector<std::pair<std::string, int64_t>> conversations(const std::string& user) = 0;
+
+    // Make everything appended so far durable. The server calls this once per
+    // event loop iteration so all messages received in one round share a commit.
+    virtual void flush() {}
+
+    // True when append() only makes a message durable at the next flush(). Its
+    // sequence number must not be given out before then: after a crash it
+    // would be handed to a different message.
+    virtual bool groupCommitted() const {
+        return false;
+    }
+
+    // True when the views history() passes stay valid for as long as the
+    // store is open, so a response can be sent from them without a copy
+    virtual bool stableHistory() const {
+        return false;
+    }
+
+    // True when the messages are in the database's full text index, which is
+    // what the search command looks in
+    virtual bool searchable() const {
+        return false;
+    }
+};
+
+// The original engine: rows in the messages/global_messages tables.
+class SqliteMessageStore : public MessageStore {
+public:
+    int64_t append(const std::string& sender, const std::string& receiver, const std::string& content, int64_t timestamp) override;
+    void history(const std::string& user1, const std::string& user2, int64_t afterSequence, const HistoryVisitor& visit) override;
+    std::vector<std::pair<std::string, int64_t>> conversations(const std::string& user) override;
+    bool searchable() const override {
+        return true;
+    }
+private:
+    int64_t nextSequence(int user1ID, int user2ID);
+    Database db;
+};
+
+// Segmented append-only log for high volume rooms.
+//
+// Every segment is a preallocated file of SEGMENT_SIZE bytes that is mapped
+// read-only for its whole life; appends go through pwrite into the same page
+// cache, so history is read straight out of the mapping. Records appended
+// since the last flush are still in memory and history leaves them out
+// rather than forcing a commit; their senders have not been answered yet.
+// Each record links to the previous record of its conversation. Besides its newest record, the
+// index keeps a sparse list of every CHECKPOINT_INTERVAL-th record of each
+// conversation, so history starts at the stretch holding the first record a
+// client is missing and replays the chain a stretch at a time, oldest first,
+// reading each stretch's part of the segment ahead. When a segment fills up the
+// index is written next to it, so recovery only has to scan the segments after
+// the last sealed one.
+class LogMessageStore : public MessageStore {
+public:
+    static const uint32_t SEGMENT_SIZE = 64 * 1024 * 1024;
+    static const int64_t CHECKPOINT_INTERVAL = 64;
+
+    explicit LogMessageStore(const std::string& directory);
+    ~LogMessageStore();
+
+    int64_t append(const std::string& sender, const std::string& receiver, const std::string& content, int64_t timestamp) override;
+    void history(const std::string& user1, const std::string& user2, int64_t afterSequence, const HistoryVisitor& visit) override;
+    std::vector<std::pair<std::string, int64_t>> conversations(const std::string& user) override;
+    void flush() override;
+    bool groupCommitted() const override {
+        return true;
+    }
+    bool stableHistory() const override {
+        return true;
+    }
+
+private:
+    struct Location {
+        uint32_t segment;
+        uint32_t offset;
+    };
+    struct Head {
+        Location location;
+        int64_t sequence = 0;
+        // Record i has sequence number 1 + i * CHECKPOINT_INTERVAL
+        std::vector<Location> checkpoints;
+    };
+    struct Segment {
+        uint32_t id;
+        int fd;
+        const char* data;
+    };
+
+    static std::string conversationKey(const std::string& user1, const std::string& user2);
+    std::string segmentPath(uint32_t id, const char* extension) const;
+    const char* recordAt(Location location) const;
+    bool committed(Location location) const;
+    Head& headOf(const std::string& key);
+    void addPartners(const std::string& key, const Head& head);
+    void advance(Head& head, Location location, int64_t sequence);
+    void openSegment(uint32_t id, bool create);
+    uint32_t scanSegment(Segment& segment);
+    bool loadIndex(uint32_t id);
+    void writeIndex(uint32_t id);
+    void rotate();
+
+    std::string directory;
+    std::vector<Segment> segments;
+    // Conversation key to the newest record and checkpoints of that conversation
+    std::unordered_map<std::string, Head> heads;
+    // User to the other user and head of each of its direct conversations
+    std::unordered_map<std::string, std::vector<std::pair<std::string, const Head*>>> partners;
+    // Records appended since the last flush, written to the active segment at
+    // writeOffset; everything before it is committed
+    std::string pending;
+    uint32_t writeOffset = 0;
+};
+
+std::unique_ptr<MessageStore> makeMessageStore(const std::string& engine);
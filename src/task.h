@@ -0,0 +1,126 @@
+#pragma once
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <utility>
+
+// A coroutine returning T that starts when it is first awaited. When it
+// finishes, the coroutine awaiting it continues right away through symmetric
+// transfer, so chains of tasks neither go through the event loop nor grow the
+// stack. Exceptions are rethrown to the awaiting coroutine.
+//
+//     Task<int> answer() { co_return 42; }
+//     Task<void> ask() { int value = co_await answer(); }
+//
+// EventLoop::spawn runs a Task<void> nobody awaits.
+template <typename T = void>
+class Task;
+
+// Ends a task by continuing the coroutine that awaited it
+struct TaskFinalAwaiter {
+    bool await_ready() noexcept {
+        return false;
+    }
+    template <typename Promise>
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> finished) noexcept {
+        std::coroutine_handle<> awaiting = finished.promise().awaiting;
+        return awaiting ? awaiting : std::noop_coroutine();
+    }
+    void await_resume() noexcept {}
+};
+
+class TaskPromiseBase {
+public:
+    std::suspend_always initial_suspend() noexcept {
+        return {};
+    }
+    TaskFinalAwaiter final_suspend() noexcept {
+        return {};
+    }
+
+    void unhandled_exception() {
+        error = std::current_exception();
+    }
+
+    std::coroutine_handle<> awaiting;
+    std::exception_ptr error;
+};
+
+template <typename T>
+class Task {
+public:
+    struct promise_type : TaskPromiseBase {
+        std::optional<T> value;
+
+        Task get_return_object() {
+            return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+        void return_value(T result) {
+            value = std::move(result);
+        }
+    };
+
+    Task(Task&& other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+    Task& operator=(Task&&) = delete;
+    ~Task() {
+        if (handle) {
+            handle.destroy();
+        }
+    }
+
+    bool await_ready() const noexcept {
+        return false;
+    }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+        handle.promise().awaiting = awaiting;
+        return handle;
+    }
+    T await_resume() {
+        if (handle.promise().error) {
+            std::rethrow_exception(handle.promise().error);
+        }
+        return std::move(*handle.promise().value);
+    }
+
+private:
+    explicit Task(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+
+    std::coroutine_handle<promise_type> handle;
+};
+
+template <>
+class Task<void> {
+public:
+    struct promise_type : TaskPromiseBase {
+        Task get_return_object() {
+            return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+        void return_void() {}
+    };
+
+    Task(Task&& other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+    Task& operator=(Task&&) = delete;
+    ~Task() {
+        if (handle) {
+            handle.destroy();
+        }
+    }
+
+    bool await_ready() const noexcept {
+        return false;
+    }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+        handle.promise().awaiting = awaiting;
+        return handle;
+    }
+    void await_resume() {
+        if (handle.promise().error) {
+            std::rethrow_exception(handle.promise().error);
+        }
+    }
+
+private:
+    explicit Task(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+
+    std::coroutine_handle<promise_type> handle;
+};
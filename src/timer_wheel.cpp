@@ -0,0 +1,149 @@
+#include "timer_wheel.h"
+#include <algorithm>
+
+TimerWheel::TimerWheel() : start(std::chrono::steady_clock::now()) {
+    std::fill(std::begin(heads), std::end(heads), NONE);
+}
+
+void TimerWheel::schedule(uint32_t id, uint32_t delayMs) {
+    if (id >= nodes.size()) {
+        nodes.resize(id + 1, {NONE, NONE, 0, UNSCHEDULED});
+    }
+    if (nodes[id].slot != UNSCHEDULED) {
+        unlink(id);
+    }
+    else {
+        count++;
+    }
+    // Round up so a timer never fires early, and always at least one tick out
+    uint32_t ticks = std::max<uint32_t>(1, (delayMs + TICK_MS - 1) / TICK_MS);
+    nodes[id].expiry = std::max(current, now()) + ticks;
+    place(id);
+}
+
+void TimerWheel::cancel(uint32_t id) {
+    if (id < nodes.size() && nodes[id].slot != UNSCHEDULED) {
+        unlink(id);
+        count--;
+    }
+}
+
+bool TimerWheel::scheduled(uint32_t id) const {
+    return id < nodes.size() && nodes[id].slot != UNSCHEDULED;
+}
+
+void TimerWheel::advance(const Callback& expire) {
+    uint32_t target = now();
+    // Signed difference keeps this correct when the tick counter wraps
+    while (static_cast<int32_t>(target - current) >= 0) {
+        uint32_t index = current & (SLOTS - 1);
+        if (index == 0) {
+            cascade(1);
+        }
+        // Detach the whole slot first, callbacks may schedule into it again.
+        // Its timers stay scheduled until they run, so a callback can still
+        // cancel or reschedule the ones behind it.
+        expiring = heads[index];
+        heads[index] = NONE;
+        for (uint32_t id = expiring; id != NONE; id = nodes[id].next) {
+            nodes[id].slot = EXPIRING;
+        }
+        while (expiring != NONE) {
+            uint32_t id = expiring;
+            unlink(id);
+            count--;
+            expire(id);
+        }
+        current++;
+    }
+}
+
+int TimerWheel::millisecondsUntilNext() const {
+    if (count == 0) {
+        return -1;
+    }
+    // Anything in the first level before it wraps is exact; otherwise wake up
+    // at the wrap, when the next level cascades down. A current tick at the
+    // start of the level has not cascaded yet, so it is the wrap itself.
+    uint32_t ticks = (SLOTS - (current & (SLOTS - 1))) & (SLOTS - 1);
+    for (uint32_t distance = 0; distance < ticks; distance++) {
+        if (heads[(current + distance) & (SLOTS - 1)] != NONE) {
+            ticks = distance;
+            break;
+        }
+    }
+    auto due = start + std::chrono::milliseconds(static_cast<int64_t>(current + ticks) * TICK_MS);
+    auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(due - std::chrono::steady_clock::now()).count();
+    return static_cast<int>(std::max<int64_t>(0, remaining));
+}
+
+uint32_t TimerWheel::now() const {
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    return static_cast<uint32_t>(elapsed / TICK_MS);
+}
+
+void TimerWheel::place(uint32_t id) {
+    Node& node = nodes[id];
+    uint32_t distance = node.expiry - current;
+    if (static_cast<int32_t>(distance) < 0) {
+        // Already due, run it with the current tick
+        node.expiry = current;
+        distance = 0;
+    }
+    const uint32_t range = 1u << (SLOT_BITS * LEVELS);
+    if (distance >= range) {
+        node.expiry = current + range - 1;
+        distance = range - 1;
+    }
+    uint32_t level = 0;
+    while (distance >= (1u << (SLOT_BITS * (level + 1)))) {
+        level++;
+    }
+    uint32_t slot = level * SLOTS + ((node.expiry >> (SLOT_BITS * level)) & (SLOTS - 1));
+    node.slot = static_cast<uint16_t>(slot);
+    node.prev = NONE;
+    node.next = heads[slot];
+    if (node.next != NONE) {
+        nodes[node.next].prev = id;
+    }
+    heads[slot] = id;
+}
+
+void TimerWheel::unlink(uint32_t id) {
+    Node& node = nodes[id];
+    if (node.prev != NONE) {
+        nodes[node.prev].next = node.next;
+    }
+    else if (node.slot == EXPIRING) {
+        expiring = node.next;
+    }
+    else {
+        heads[node.slot] = node.next;
+    }
+    if (node.next != NONE) {
+        nodes[node.next].prev = node.prev;
+    }
+    node.next = NONE;
+    node.prev = NONE;
+    node.slot = UNSCHEDULED;
+}
+
+// Move the timers of the level's current slot down to finer levels. When that
+// slot is the level's first, the next level has wrapped too and goes first.
+void TimerWheel::cascade(uint32_t level) {
+    if (level >= LEVELS) {
+        return;
+    }
+    uint32_t index = (current >> (SLOT_BITS * level)) & (SLOTS - 1);
+    if (index == 0) {
+        cascade(level + 1);
+    }
+    uint32_t slot = level * SLOTS + index;
+    uint32_t id = heads[slot];
+    heads[slot] = NONE;
+    while (id != NONE) {
+        uint32_t next = nodes[id].next;
+        place(id);
+        id = next;
+    }
+}
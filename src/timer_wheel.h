@@ -0,0 +1,61 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+// Hierarchical timing wheel: 4 levels of 64 slots with a 10ms tick, so timers
+// up to ~46 hours away cost O(1) to schedule, cancel and expire. Timers are
+// identified by small dense ids (the server uses clientfds) and each one is a
+// 16 byte node, there is no per-timer allocation or kernel timer.
+class TimerWheel {
+public:
+    using Callback = std::function<void(uint32_t id)>;
+
+    static constexpr uint32_t TICK_MS = 10;
+
+    TimerWheel();
+
+    // Fire id after delayMs, replacing any pending timer with the same id
+    void schedule(uint32_t id, uint32_t delayMs);
+    void cancel(uint32_t id);
+    bool scheduled(uint32_t id) const;
+
+    // Run every timer that is due; callbacks may schedule and cancel timers
+    void advance(const Callback& expire);
+
+    // How long select may sleep before the next call to advance, -1 for forever
+    int millisecondsUntilNext() const;
+
+    // Current time in ticks, cheap enough to stamp on every message
+    uint32_t now() const;
+
+private:
+    static constexpr uint32_t LEVELS = 4;
+    static constexpr uint32_t SLOT_BITS = 6;
+    static constexpr uint32_t SLOTS = 1 << SLOT_BITS;
+    static constexpr uint32_t NONE = UINT32_MAX;
+    static constexpr uint16_t UNSCHEDULED = UINT16_MAX;
+    // In the slot advance is running
+    static constexpr uint16_t EXPIRING = UINT16_MAX - 1;
+
+    struct Node {
+        uint32_t next;
+        uint32_t prev;
+        uint32_t expiry; // in ticks, wraps around
+        uint16_t slot; // level * SLOTS + index, EXPIRING while its slot runs, UNSCHEDULED when idle
+    };
+
+    void place(uint32_t id);
+    void unlink(uint32_t id);
+    void cascade(uint32_t level);
+
+    std::chrono::steady_clock::time_point start;
+    // Next tick to process
+    uint32_t current = 0;
+    uint32_t count = 0;
+    // Timers of the slot being expired that have not run yet
+    uint32_t expiring = NONE;
+    uint32_t heads[LEVELS * SLOTS];
+    std::vector<Node> nodes;
+};
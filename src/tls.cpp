@@ -0,0 +1,206 @@
+#include "tls.h"
+#include <arpa/inet.h>
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <cerrno>
+#include <iostream>
+#include <memory>
+#include <unordered_map>
+
+namespace {
+
+struct Session {
+    SSL* ssl;
+    bool established = false;
+    bool kernelSend = false;
+    bool kernelReceive = false;
+};
+
+// Looked up by fd; the server and the client library are single threaded
+std::unordered_map<int, std::unique_ptr<Session>> sessions;
+
+Session* find(int fd) {
+    auto session = sessions.find(fd);
+    return session == sessions.end() ? nullptr : session->second.get();
+}
+
+void established(int fd, Session& session) {
+    session.established = true;
+    // Every message is already a single record; don't let Nagle hold one back
+    // behind the last handshake flight waiting for a delayed ACK
+    int optval = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+    session.kernelSend = BIO_get_ktls_send(SSL_get_wbio(session.ssl));
+    session.kernelReceive = BIO_get_ktls_recv(SSL_get_rbio(session.ssl));
+}
+
+SSL_CTX* newContext(const SSL_METHOD* method) {
+    SSL_CTX* context = SSL_CTX_new(method);
+    SSL_CTX_set_min_proto_version(context, TLS1_2_VERSION);
+    // Use kTLS whenever the kernel and the negotiated cipher allow it
+    SSL_CTX_set_options(context, SSL_OP_ENABLE_KTLS);
+    // Nonblocking writers retry from a buffer that may have grown and moved
+    SSL_CTX_set_mode(context, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    return context;
+}
+
+// Map an OpenSSL result onto read()/write() conventions
+ssize_t result(SSL* ssl, int bytes) {
+    if (bytes > 0) {
+        return bytes;
+    }
+    switch (SSL_get_error(ssl, bytes)) {
+        case SSL_ERROR_ZERO_RETURN:
+            return 0;
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            errno = EAGAIN;
+            return -1;
+        case SSL_ERROR_SYSCALL:
+            if (errno == 0) {
+                errno = EIO;
+            }
+            return -1;
+        default:
+            ERR_clear_error();
+            errno = EIO;
+            return -1;
+    }
+}
+
+}
+
+SSL_CTX* tlsServerContext(const std::string& certFile, const std::string& keyFile) {
+    SSL_CTX* context = newContext(TLS_server_method());
+    if (SSL_CTX_use_certificate_chain_file(context, certFile.c_str()) != 1 ||
+        SSL_CTX_use_PrivateKey_file(context, keyFile.c_str(), SSL_FILETYPE_PEM) != 1) {
+        std::cerr << "Cannot load TLS certificate " << certFile << " and key " << keyFile << std::endl;
+        exit(1);
+    }
+    // Session tickets would be records the client's kTLS receive path cannot take
+    SSL_CTX_set_num_tickets(context, 0);
+    return context;
+}
+
+SSL_CTX* tlsClientContext(const std::string& caFile) {
+    SSL_CTX* context = newContext(TLS_client_method());
+    if (SSL_CTX_load_verify_locations(context, caFile.c_str(), NULL) != 1) {
+        std::cerr << "Cannot load TLS certificates from " << caFile << std::endl;
+        exit(1);
+    }
+    SSL_CTX_set_verify(context, SSL_VERIFY_PEER, NULL);
+    return context;
+}
+
+TlsStatus tlsAccept(SSL_CTX* context, int fd) {
+    Session* session = find(fd);
+    if (session == nullptr) {
+        sessions[fd] = std::make_unique<Session>();
+        session = sessions[fd].get();
+        session->ssl = SSL_new(context);
+        SSL_set_fd(session->ssl, fd);
+    }
+    int accepted = SSL_accept(session->ssl);
+    if (accepted == 1) {
+        established(fd, *session);
+        return TlsStatus::DONE;
+    }
+    int error = SSL_get_error(session->ssl, accepted);
+    if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) {
+        return TlsStatus::PENDING;
+    }
+    ERR_clear_error();
+    return TlsStatus::FAILED;
+}
+
+TlsStatus tlsConnectNonblocking(SSL_CTX* context, int fd, const std::string& host) {
+    Session* session = find(fd);
+    if (session == nullptr) {
+        sessions[fd] = std::make_unique<Session>();
+        session = sessions[fd].get();
+        session->ssl = SSL_new(context);
+        SSL_set_fd(session->ssl, fd);
+        in_addr address;
+        X509_VERIFY_PARAM* param = SSL_get0_param(session->ssl);
+        if (inet_pton(AF_INET, host.c_str(), &address) == 1) {
+            X509_VERIFY_PARAM_set1_ip_asc(param, host.c_str());
+        }
+        else {
+            X509_VERIFY_PARAM_set1_host(param, host.c_str(), 0);
+            SSL_set_tlsext_host_name(session->ssl, host.c_str());
+        }
+    }
+    int connected = SSL_connect(session->ssl);
+    if (connected == 1) {
+        established(fd, *session);
+        return TlsStatus::DONE;
+    }
+    int error = SSL_get_error(session->ssl, connected);
+    if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) {
+        return TlsStatus::PENDING;
+    }
+    std::cerr << "TLS handshake failed: " << X509_verify_cert_error_string(SSL_get_verify_result(session->ssl)) << std::endl;
+    ERR_clear_error();
+    tlsForget(fd);
+    return TlsStatus::FAILED;
+}
+
+bool tlsConnect(SSL_CTX* context, int fd, const std::string& host) {
+    // A blocking socket finishes the handshake in one call
+    return tlsConnectNonblocking(context, fd, host) == TlsStatus::DONE;
+}
+
+void tlsForget(int fd) {
+    auto session = sessions.find(fd);
+    if (session != sessions.end()) {
+        SSL_free(session->second->ssl);
+        sessions.erase(session);
+    }
+}
+
+std::string tlsMode(int fd) {
+    Session* session = find(fd);
+    if (session == nullptr) {
+        return "plaintext";
+    }
+    if (session->kernelSend && session->kernelReceive) {
+        return "kTLS";
+    }
+    return session->kernelSend ? "kTLS send" : "userspace TLS";
+}
+
+bool tlsInKernel(int fd) {
+    Session* session = find(fd);
+    return session == nullptr || (session->established && session->kernelSend && session->kernelReceive);
+}
+
+bool tlsSendsInKernel(int fd) {
+    Session* session = find(fd);
+    return session == nullptr || (session->established && session->kernelSend);
+}
+
+bool tlsPending(int fd) {
+    Session* session = find(fd);
+    if (session == nullptr || session->kernelReceive) {
+        return false;
+    }
+    return SSL_pending(session->ssl) > 0;
+}
+
+ssize_t tlsRead(int fd, void* data, size_t size) {
+    Session* session = find(fd);
+    if (session == nullptr || session->kernelReceive) {
+        return read(fd, data, size);
+    }
+    return result(session->ssl, SSL_read(session->ssl, data, size));
+}
+
+ssize_t tlsWrite(int fd, const void* data, size_t size) {
+    Session* session = find(fd);
+    if (session == nullptr || session->kernelSend) {
+        return write(fd, data, size);
+    }
+    return result(session->ssl, SSL_write(session->ssl, data, size));
+}
@@ -0,0 +1,51 @@
+#pragma once
+#include <openssl/ssl.h>
+#include <sys/types.h>
+#include <string>
+
+// Optional TLS transport. OpenSSL does the handshake and then, where the
+// kernel supports it, hands record encryption to kTLS: from there on the
+// socket is written (and read) with plain write()/read() and the kernel
+// encrypts as it copies into the socket buffer, so sending costs no extra
+// userspace copy or crypto pass. A direction kTLS could not take over goes
+// through SSL_write/SSL_read instead.
+//
+// Connections are looked up by fd, so sendMessage/receiveMessage work the
+// same over plaintext and TLS connections.
+
+enum class TlsStatus {
+    DONE,
+    PENDING, // call again once the socket is readable
+    FAILED
+};
+
+// Both exit when the certificate or key cannot be loaded
+SSL_CTX* tlsServerContext(const std::string& certFile, const std::string& keyFile);
+// The server must present a certificate signed by caFile (its own
+// certificate when it is self-signed) for the address it was reached at
+SSL_CTX* tlsClientContext(const std::string& caFile);
+
+// Server side handshake on a nonblocking socket
+TlsStatus tlsAccept(SSL_CTX* context, int fd);
+// Client side handshake on a blocking socket
+bool tlsConnect(SSL_CTX* context, int fd, const std::string& host);
+// Client side handshake on a nonblocking socket, a failure is reported on stderr
+TlsStatus tlsConnectNonblocking(SSL_CTX* context, int fd, const std::string& host);
+
+// Drop the TLS state of fd, before closing it or giving it to another process
+void tlsForget(int fd);
+
+// How fd is encrypted: "plaintext", "kTLS", "kTLS send" or "userspace TLS"
+std::string tlsMode(int fd);
+// True when fd needs no userspace TLS state, so it can be used (and handed
+// to another process) like a plain socket
+bool tlsInKernel(int fd);
+// True when bytes written to fd go to the socket as they are (plaintext or
+// kTLS send), so they can also be gathered with writev()
+bool tlsSendsInKernel(int fd);
+// Data already decrypted in userspace that select() cannot see
+bool tlsPending(int fd);
+
+// read()/write() that go through OpenSSL where the kernel is not doing TLS
+ssize_t tlsRead(int fd, void* data, size_t size);
+ssize_t tlsWrite(int fd, const void* data, size_t size);
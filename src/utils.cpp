@@ -1,6 +1,12 @@
 #include "utils.h"
+#include "tls.h"
 #include <fcntl.h>
+#include <poll.h>
+#include <cerrno>
+#include <charconv>
 #include <chrono>
+#include <cstring>
+#include <ctime>
 #include <sstream>
 #include <iomanip>
 #include <random>
@@ -11,6 +17,20 @@ std::string timePointToString(std::chrono::system_clock::time_point time) {
     return std::to_string(unix_timestamp);
 }
 
+std::string messageTypeName(Message::Type type) {
+    switch (type) {
+        case Message::Type::CHAT: return "CHAT";
+        case Message::Type::AUTH: return "AUTH";
+        case Message::Type::COMMAND: return "COMMAND";
+        case Message::Type::CLOSE: return "CLOSE";
+        case Message::Type::ACK: return "ACK";
+        case Message::Type::PING: return "PING";
+        case Message::Type::PONG: return "PONG";
+        case Message::Type::ERROR: return "ERROR";
+    }
+    return "";
+}
+
 uint64_t htonll(uint64_t value) {
     return ((static_cast<uint64_t>(htonl(static_cast<uint32_t>(value))) << 32) |
             htonl(static_cast<uint32_t>(value >> 32)));
@@ -22,90 +42,209 @@ uint64_t ntohll(uint64_t value) {
             ntohl(static_cast<uint32_t>(value >> 32)));
 }
 
-bool sendString(int sockfd, const std::string& message) {
-    size_t messageSize = message.size();
-    if (write(sockfd, &messageSize, sizeof(messageSize)) < 0) {
-        return false;
+// A busy peer's socket buffer fills up and messages arrive in pieces, so
+// reads and writes go on until the whole field has been transferred. On a
+// nonblocking socket a write waits for room in the socket buffer.
+bool writeFully(int sockfd, const void* data, size_t size) {
+    const char* position = static_cast<const char*>(data);
+    while (size > 0) {
+        ssize_t written = tlsWrite(sockfd, position, size);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written < 0 && errno == EAGAIN) {
+            pollfd writable = {sockfd, POLLOUT, 0};
+            poll(&writable, 1, -1);
+            continue;
+        }
+        if (written <= 0) {
+            return false;
+        }
+        position += written;
+        size -= written;
     }
-    if (write(sockfd, message.c_str(), messageSize) < 0) {
-        return false;
+    return true;
+}
+
+bool readFully(int sockfd, void* data, size_t size) {
+    char* position = static_cast<char*>(data);
+    while (size > 0) {
+        ssize_t bytes = tlsRead(sockfd, position, size);
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes <= 0) {
+            return false;
+        }
+        position += bytes;
+        size -= bytes;
     }
     return true;
 }
 
-bool receiveString(int sockfd, std::string& message) {
+bool receiveString(int sockfd, std::string& message, size_t& remaining) {
     size_t messageSize;
-    if (read(sockfd, &messageSize, sizeof(messageSize)) <= 0) {
+    if (!readFully(sockfd, &messageSize, sizeof(messageSize)) || messageSize > remaining) {
         return false;
     }
+    remaining -= messageSize;
     message.resize(messageSize);
-    if (read(sockfd, &message[0], messageSize) < 0) {
+    if (!readFully(sockfd, &message[0], messageSize)) {
         return false;
     }
     return true;
 }
 
-bool sendMessage(int sockfd, const Message& message) {
-    Message::Type type = message.type;
-    int32_t typeInt = static_cast<int32_t>(type);
+static void appendString(std::string& buffer, const std::string& value) {
+    size_t size = value.size();
+    buffer.append(reinterpret_cast<const char*>(&size), sizeof(size));
+    buffer += value;
+}
 
-    if (write(sockfd, &typeInt, sizeof(typeInt)) < 0) {
-        return false;
-    }
+std::string encodeMessage(const Message& message) {
+    int32_t typeInt = static_cast<int32_t>(message.type);
+    std::string buffer;
+    buffer.append(reinterpret_cast<const char*>(&typeInt), sizeof(typeInt));
+    appendString(buffer, message.sender);
+    appendString(buffer, message.receiver);
+    appendString(buffer, message.content);
+    appendString(buffer, message.token);
+    appendString(buffer, timePointToString(message.timestamp));
+    appendString(buffer, std::to_string(message.sequence));
+    return buffer;
+}
 
-    if (!sendString(sockfd, message.sender)) {
-        return false;
-    }
+void encodeMessageAround(const Message& message, size_t contentSize, std::string& head, std::string& tail) {
+    int32_t typeInt = static_cast<int32_t>(message.type);
+    head.clear();
+    head.append(reinterpret_cast<const char*>(&typeInt), sizeof(typeInt));
+    appendString(head, message.sender);
+    appendString(head, message.receiver);
+    head.append(reinterpret_cast<const char*>(&contentSize), sizeof(contentSize));
+    tail.clear();
+    appendString(tail, message.token);
+    appendString(tail, timePointToString(message.timestamp));
+    appendString(tail, std::to_string(message.sequence));
+}
 
-    if (!sendString(sockfd, message.receiver)) {
-        return false;
-    }
+const int MESSAGE_FIELDS = 6;
 
-    if (!sendString(sockfd, message.content)) {
-        return false;
+size_t messageLength(std::string_view data, size_t maxSize) {
+    // The type, then every field's size followed by the field
+    size_t length = sizeof(int32_t);
+    for (int field = 0; field < MESSAGE_FIELDS; field++) {
+        size_t size;
+        if (length > maxSize || maxSize - length < sizeof(size)) {
+            return MALFORMED_MESSAGE;
+        }
+        if (data.size() < length + sizeof(size)) {
+            return 0;
+        }
+        std::memcpy(&size, data.data() + length, sizeof(size));
+        length += sizeof(size);
+        if (size > maxSize - length) {
+            return MALFORMED_MESSAGE;
+        }
+        length += size;
     }
+    return data.size() < length ? 0 : length;
+}
 
-    if (!sendString(sockfd, message.token)) {
-        return false;
-    }
+// Take one length prefixed field off the front of data, which holds all of it
+static std::string_view takeString(std::string_view& data) {
+    size_t size;
+    std::memcpy(&size, data.data(), sizeof(size));
+    std::string_view value = data.substr(sizeof(size), size);
+    data.remove_prefix(sizeof(size) + size);
+    return value;
+}
 
-    std::string timestamp = timePointToString(message.timestamp);
-    if(!sendString(sockfd, timestamp)) {
-        return false;
+// The whole of text is a decimal number
+template <typename Integer>
+static bool parseInteger(std::string_view text, Integer& value) {
+    auto parsed = std::from_chars(text.data(), text.data() + text.size(), value);
+    return parsed.ec == std::errc() && parsed.ptr == text.data() + text.size();
+}
+
+size_t decodeMessage(std::string_view data, Message& message, size_t maxSize) {
+    size_t length = messageLength(data, maxSize);
+    if (length == 0 || length == MALFORMED_MESSAGE) {
+        return length;
+    }
+    int32_t typeInt;
+    std::memcpy(&typeInt, data.data(), sizeof(typeInt));
+    if (typeInt < 0 || typeInt > static_cast<int32_t>(Message::Type::ERROR)) {
+        return MALFORMED_MESSAGE;
+    }
+    std::string_view rest = data.substr(sizeof(typeInt), length - sizeof(typeInt));
+    std::string_view sender = takeString(rest);
+    std::string_view receiver = takeString(rest);
+    std::string_view content = takeString(rest);
+    std::string_view token = takeString(rest);
+    std::string_view timestamp = takeString(rest);
+    std::string_view sequence = takeString(rest);
+    int64_t seconds;
+    int64_t sequenceNumber;
+    if (!parseInteger(timestamp, seconds) || !parseInteger(sequence, sequenceNumber)) {
+        return MALFORMED_MESSAGE;
     }
+    message.type = static_cast<Message::Type>(typeInt);
+    message.sender = sender;
+    message.receiver = receiver;
+    message.content = content;
+    message.token = token;
+    message.timestamp = intToTimePoint(seconds);
+    message.sequence = sequenceNumber;
+    return length;
+}
 
-    return true;
+// The whole message goes out in one write; field by field writes leave small
+// segments for Nagle's algorithm to hold back until the peer's delayed ACK
+bool sendMessage(int sockfd, const Message& message) {
+    std::string buffer = encodeMessage(message);
+    return writeFully(sockfd, buffer.data(), buffer.size());
 }
 
-bool receiveMessage(int sockfd, Message& message) {
+bool receiveMessage(int sockfd, Message& message, size_t maxSize) {
     int32_t typeInt;
-    if (read(sockfd, &typeInt, sizeof(typeInt)) < 0) {
+    if (!readFully(sockfd, &typeInt, sizeof(typeInt))) {
+        return false;
+    }
+    if (typeInt < 0 || typeInt > static_cast<int32_t>(Message::Type::ERROR)) {
         return false;
     }
     message.type = static_cast<Message::Type>(typeInt);
-    
-    if (!receiveString(sockfd, message.sender)) {
+    // Only as much as the largest message allowed is ever allocated
+    size_t remaining = maxSize;
+
+    if (!receiveString(sockfd, message.sender, remaining)) {
         return false;
     }
 
-    if (!receiveString(sockfd, message.receiver)) {
+    if (!receiveString(sockfd, message.receiver, remaining)) {
         return false;
     }
 
-    if (!receiveString(sockfd, message.content)) {
+    if (!receiveString(sockfd, message.content, remaining)) {
         return false;
     }
 
-    if (!receiveString(sockfd, message.token)) {
+    if (!receiveString(sockfd, message.token, remaining)) {
         return false;
     }
 
     // Receive timestamp
     std::string timestamp;
-    if (!receiveString(sockfd, timestamp)) {
+    int64_t seconds;
+    if (!receiveString(sockfd, timestamp, remaining) || !parseInteger(timestamp, seconds)) {
+        return false;
+    }
+    message.timestamp = intToTimePoint(seconds);
+
+    std::string sequence;
+    if (!receiveString(sockfd, sequence, remaining) || !parseInteger(sequence, message.sequence)) {
         return false;
     }
-    message.timestamp = intToTimePoint(std::stoi(timestamp));
 
     return true;
 }
@@ -127,20 +266,72 @@ std::string generateRandomToken() {
     return token;
 }
 
+bool isRoom(const std::string& receiver) {
+    return !receiver.empty() && receiver[0] == '#';
+}
+
+bool parseHistoryLine(std::string_view line, int64_t& sequence, int64_t& timestamp, std::string_view& sender, std::string_view& content) {
+    const char* end = line.data() + line.size();
+    auto parsed = std::from_chars(line.data(), end, sequence);
+    if (parsed.ec != std::errc() || parsed.ptr == end) {
+        return false;
+    }
+    parsed = std::from_chars(parsed.ptr + 1, end, timestamp);
+    if (parsed.ec != std::errc() || parsed.ptr == end) {
+        return false;
+    }
+    // Sender names have no spaces, messages may
+    std::string_view senderAndContent = line.substr(parsed.ptr + 1 - line.data());
+    size_t space = senderAndContent.find(' ');
+    sender = senderAndContent.substr(0, space);
+    content = space == std::string_view::npos ? std::string_view() : senderAndContent.substr(space + 1);
+    return true;
+}
+
 std::string formatTimestamp(int64_t timestampSeconds) {
-    // Convert seconds to time_t
-    std::time_t tt = static_cast<std::time_t>(timestampSeconds);
-    
-    // Convert time_t to tm structure
-    std::tm tm = *std::localtime(&tt);
+    thread_local TimestampFormatter formatter;
+    std::string result;
+    formatter.append(result, timestampSeconds);
+    return result;
+}
+
+static int64_t startOf(int64_t seconds, int64_t span) {
+    return seconds - ((seconds % span) + span) % span;
+}
 
-    // Format using ostringstream
-    std::ostringstream oss;
-    oss << std::put_time(&tm, "%Y-%m-%d %H:%M:%S");  // Format as "YYYY-MM-DD HH:MM:SS"
-    return oss.str();
+void TimestampFormatter::append(std::string& out, int64_t timestampSeconds) {
+    // Offsets from UTC change on a UTC half hour (zones like Lord Howe and
+    // Newfoundland are half an hour off), so the offset is looked up once per
+    // UTC half hour and the prefix follows the local hour on its own
+    if (timestampSeconds < spanStart || timestampSeconds >= spanStart + 1800) {
+        std::time_t tt = static_cast<std::time_t>(timestampSeconds);
+        std::tm tm;
+        localtime_r(&tt, &tm);
+        spanStart = startOf(timestampSeconds, 1800);
+        if (tm.tm_gmtoff != gmtoff) {
+            gmtoff = tm.tm_gmtoff;
+            prefixSize = 0;
+        }
+    }
+    int64_t local = timestampSeconds + gmtoff;
+    int64_t localHourStart = startOf(local, 3600);
+    if (prefixSize == 0 || localHourStart != prefixHourStart) {
+        std::time_t tt = static_cast<std::time_t>(localHourStart);
+        std::tm tm;
+        gmtime_r(&tt, &tm);
+        prefixHourStart = localHourStart;
+        prefixSize = std::strftime(prefix, sizeof(prefix), "%Y-%m-%d %H:", &tm);
+    }
+    int64_t inHour = local - localHourStart;
+    char minutesSeconds[5] = {
+        static_cast<char>('0' + inHour / 600), static_cast<char>('0' + inHour / 60 % 10), ':',
+        static_cast<char>('0' + inHour % 60 / 10), static_cast<char>('0' + inHour % 10)
+    };
+    out.append(prefix, prefixSize);
+    out.append(minutesSeconds, sizeof(minutesSeconds));
 }
 
-std::chrono::system_clock::time_point intToTimePoint(int timestamp) {
+std::chrono::system_clock::time_point intToTimePoint(int64_t timestamp) {
     return std::chrono::system_clock::time_point{std::chrono::seconds(timestamp)};
 }
 
@@ -152,7 +343,7 @@ void emptySocket(int sockfd) {
     // Drain the socket
     char buffer[1024];
     while (true) {
-        ssize_t bytes = recv(sockfd, buffer, sizeof(buffer), 0);
+        ssize_t bytes = tlsRead(sockfd, buffer, sizeof(buffer));
         if (bytes <= 0) {
             break; // No more data or error
         }
@@ -4,7 +4,9 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <cstdint>
 #include <string>
+#include <string_view>
 #include <chrono>
 #include <iostream>
 
@@ -14,6 +16,10 @@ struct Message {
         AUTH,
         COMMAND,
         CLOSE,
+        ACK,
+        PING,
+        PONG,
+        ERROR, // Server refused the request, reason in content
     };
     Type type;
     std::string sender; // Field for username on auth
@@ -21,18 +27,68 @@ struct Message {
     std::string content; // Field for command on command, content is returned in this field too
     std::string token;
     std::chrono::time_point<std::chrono::system_clock> timestamp;
+    int64_t sequence = 0; // Server assigned position in the conversation, 0 when not applicable
 };
 
 std::string timePointToString(std::chrono::system_clock::time_point time);
 
+// "CHAT", "AUTH", ...; an ERROR names the type of the request it refuses this way
+std::string messageTypeName(Message::Type type);
+
+// The bytes sendMessage writes for message
+std::string encodeMessage(const Message& message);
+
+// encodeMessage without the content bytes, for a content of contentSize bytes
+// written from somewhere else: head ends with the content's size, tail holds
+// the fields after it
+void encodeMessageAround(const Message& message, size_t contentSize, std::string& head, std::string& tail);
+
+// What messageLength and decodeMessage return for bytes that are not a message
+const size_t MALFORMED_MESSAGE = SIZE_MAX;
+
+// Size of the message at the front of data, 0 when data does not hold all of
+// it yet, MALFORMED_MESSAGE once its fields add up to more than maxSize
+size_t messageLength(std::string_view data, size_t maxSize = SIZE_MAX);
+
+// Decode the message at the front of data. Returns how many bytes it took, 0
+// when data does not hold a whole message yet, or MALFORMED_MESSAGE when it is
+// longer than maxSize, of an unknown type or has a timestamp or sequence
+// number that is not a number.
+size_t decodeMessage(std::string_view data, Message& message, size_t maxSize = SIZE_MAX);
+
 bool sendMessage(int sockfd, const Message& message);
 
-bool receiveMessage(int sockfd, Message& message);
+// Blocking read of one message, false when the connection closed or the
+// message is malformed or longer than maxSize
+bool receiveMessage(int sockfd, Message& message, size_t maxSize = SIZE_MAX);
 
 std::string generateRandomToken();
 
+// Room conversations are addressed as "#<room name>"
+bool isRoom(const std::string& receiver);
+
+// Split a "sequence timestamp sender message" line of a chat history. The
+// views point into line; false when it is not such a line.
+bool parseHistoryLine(std::string_view line, int64_t& sequence, int64_t& timestamp, std::string_view& sender, std::string_view& content);
+
 std::string formatTimestamp(int64_t timestampSeconds);
 
-std::chrono::system_clock::time_point intToTimePoint(int timestamp);
+// Appends "YYYY-MM-DD HH:MM:SS" in local time for many timestamps in a row.
+// localtime runs once per UTC half hour of timestamps rather than once per
+// line, the date and hour are only formatted again when the local hour or the
+// offset from UTC changes, and nothing is allocated beyond what out grows by.
+class TimestampFormatter {
+public:
+    void append(std::string& out, int64_t timestampSeconds);
+private:
+    // Starts out of reach of any timestamp so the first call looks up the offset
+    int64_t spanStart = INT64_MIN;
+    long gmtoff = 0;
+    int64_t prefixHourStart = 0;
+    char prefix[16]; // "YYYY-MM-DD HH:"
+    size_t prefixSize = 0;
+};
+
+std::chrono::system_clock::time_point intToTimePoint(int64_t timestamp);
 
 void emptySocket(int sockfd);
\ No newline at end of file